@@ -0,0 +1,193 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "batch_spool.h"
+#include "util/stringutil.h"
+#include "util/time.h"
+
+static const char kBatchSuffix[] = ".batch";
+
+BatchSpool::BatchSpool(const std::string& dir) : dir_(dir), seq_(0) {}
+
+ReturnCode BatchSpool::open() {
+  if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+    return ReturnCode::error(
+        "EIO",
+        "can't create %s: %s",
+        dir_.c_str(),
+        strerror(errno));
+  }
+
+  struct stat st;
+  if (stat(dir_.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    return ReturnCode::error("EIO", "%s is not a directory", dir_.c_str());
+  }
+
+  if (access(dir_.c_str(), W_OK | X_OK) != 0) {
+    return ReturnCode::error(
+        "EIO",
+        "spool directory %s is not writable: %s",
+        dir_.c_str(),
+        strerror(errno));
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode BatchSpool::write(
+    const std::string& data,
+    size_t nrows,
+    const std::string& content_encoding,
+    std::string* path) {
+  auto name = StringUtil::format(
+      "$0-$1-$2.$3$4",
+      WallClock::unixMicros(),
+      getpid(),
+      seq_++,
+      nrows,
+      kBatchSuffix);
+
+  if (!content_encoding.empty()) {
+    name += "." + content_encoding;
+  }
+
+  *path = dir_ + "/" + name;
+  auto tmp_path = dir_ + "/." + name + ".tmp";
+
+  auto file = fopen(tmp_path.c_str(), "wb");
+  if (!file) {
+    return ReturnCode::error(
+        "EIO",
+        "can't open %s: %s",
+        tmp_path.c_str(),
+        strerror(errno));
+  }
+
+  auto written = fwrite(data.data(), 1, data.size(), file);
+  auto rc = fflush(file) == 0 && fsync(fileno(file)) == 0;
+  fclose(file);
+
+  if (written != data.size() || !rc) {
+    unlink(tmp_path.c_str());
+    return ReturnCode::error(
+        "EIO",
+        "can't write %s: %s",
+        tmp_path.c_str(),
+        strerror(errno));
+  }
+
+  if (rename(tmp_path.c_str(), path->c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return ReturnCode::error(
+        "EIO",
+        "can't rename %s: %s",
+        tmp_path.c_str(),
+        strerror(errno));
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode BatchSpool::list(std::vector<Entry>* entries) const {
+  auto dir = opendir(dir_.c_str());
+  if (!dir) {
+    return ReturnCode::error(
+        "EIO",
+        "can't open %s: %s",
+        dir_.c_str(),
+        strerror(errno));
+  }
+
+  std::vector<std::string> names;
+  for (struct dirent* ent; (ent = readdir(dir)) != nullptr; ) {
+    if (ent->d_name[0] != '.') {
+      names.emplace_back(ent->d_name);
+    }
+  }
+
+  closedir(dir);
+
+  /* names start with the creation time */
+  std::sort(names.begin(), names.end());
+
+  for (const auto& name : names) {
+    /* <id>.<nrows>.batch[.<content encoding>] */
+    auto parts = StringUtil::split(name, ".");
+    if (parts.size() < 3 ||
+        parts.size() > 4 ||
+        "." + parts[2] != kBatchSuffix ||
+        parts[1].empty() ||
+        parts[1].find_first_not_of("0123456789") != std::string::npos) {
+      continue;
+    }
+
+    Entry entry;
+    entry.path = dir_ + "/" + name;
+    entry.nrows = std::stoull(parts[1]);
+    if (parts.size() == 4) {
+      entry.content_encoding = parts[3];
+    }
+
+    entries->emplace_back(entry);
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode BatchSpool::read(const std::string& path, std::string* data) {
+  auto file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return ReturnCode::error(
+        "EIO",
+        "can't open %s: %s",
+        path.c_str(),
+        strerror(errno));
+  }
+
+  data->clear();
+  char buf[65536];
+  for (;;) {
+    auto len = fread(buf, 1, sizeof(buf), file);
+    data->append(buf, len);
+    if (len < sizeof(buf)) {
+      break;
+    }
+  }
+
+  auto failed = ferror(file);
+  fclose(file);
+
+  if (failed) {
+    return ReturnCode::error("EIO", "can't read %s", path.c_str());
+  }
+
+  return ReturnCode::success();
+}
+
@@ -0,0 +1,79 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include "util/return_code.h"
+
+/**
+ * A directory of batches that could not be uploaded.
+ *
+ * Each batch is stored in its own file named
+ * <id>.<nrows>.batch[.<content encoding>]. The file holds the upload shard
+ * data exactly as it was queued: the records joined with ',' or, with a
+ * content encoding, the complete compressed request body. Files are written
+ * under a temporary name and renamed, so a listing never includes a partial
+ * batch.
+ */
+class BatchSpool {
+public:
+
+  struct Entry {
+    std::string path;
+    size_t nrows;
+    std::string content_encoding;
+  };
+
+  BatchSpool(const std::string& dir);
+
+  /**
+   * Create the spool directory if it does not exist and check that batches
+   * can be written to it
+   */
+  ReturnCode open();
+
+  /**
+   * Write a batch to the spool
+   */
+  ReturnCode write(
+      const std::string& data,
+      size_t nrows,
+      const std::string& content_encoding,
+      std::string* path);
+
+  /**
+   * List the batches in the spool, oldest first
+   */
+  ReturnCode list(std::vector<Entry>* entries) const;
+
+  /**
+   * Read the data of a spooled batch
+   */
+  static ReturnCode read(const std::string& path, std::string* data);
+
+protected:
+  std::string dir_;
+  size_t seq_;
+};
+
@@ -0,0 +1,210 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "batch_spool.h"
+
+/**
+ * Checks the file naming, listing and write/read round trip of BatchSpool.
+ * Exits with a non-zero status if any check fails
+ */
+
+#define EXPECT(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      ++num_failures; \
+    } \
+  } while (0)
+
+static size_t num_failures = 0;
+
+static void touch(const std::string& path, const std::string& data) {
+  auto file = fopen(path.c_str(), "wb");
+  if (file) {
+    fwrite(data.data(), 1, data.size(), file);
+    fclose(file);
+  }
+}
+
+static void removeDir(const std::string& path) {
+  auto dir = opendir(path.c_str());
+  if (!dir) {
+    return;
+  }
+
+  for (struct dirent* ent; (ent = readdir(dir)) != nullptr; ) {
+    std::string name(ent->d_name);
+    if (name != "." && name != "..") {
+      unlink((path + "/" + name).c_str());
+    }
+  }
+
+  closedir(dir);
+  rmdir(path.c_str());
+}
+
+static void testRoundTrip(const std::string& base) {
+  auto dir = base + "/round_trip";
+  BatchSpool spool(dir);
+  EXPECT(spool.open().isSuccess());
+
+  std::string plain = "{\"a\":1},{\"a\":2},{\"a\":3}";
+  std::string binary("\x1f\x8b\0\xff", 4);
+  binary += std::string(200000, 'x');
+
+  std::string plain_path;
+  std::string binary_path;
+  EXPECT(spool.write(plain, 3, "", &plain_path).isSuccess());
+  EXPECT(spool.write(binary, 7, "gzip", &binary_path).isSuccess());
+
+  std::vector<BatchSpool::Entry> entries;
+  EXPECT(spool.list(&entries).isSuccess());
+  EXPECT(entries.size() == 2);
+  if (entries.size() == 2) {
+    EXPECT(entries[0].path == plain_path);
+    EXPECT(entries[0].nrows == 3);
+    EXPECT(entries[0].content_encoding.empty());
+    EXPECT(entries[1].path == binary_path);
+    EXPECT(entries[1].nrows == 7);
+    EXPECT(entries[1].content_encoding == "gzip");
+  }
+
+  std::string data;
+  EXPECT(BatchSpool::read(plain_path, &data).isSuccess());
+  EXPECT(data == plain);
+  EXPECT(BatchSpool::read(binary_path, &data).isSuccess());
+  EXPECT(data == binary);
+
+  EXPECT(BatchSpool::read(dir + "/missing.1.batch", &data).isError());
+  removeDir(dir);
+}
+
+static void testListParsing(const std::string& base) {
+  auto dir = base + "/parsing";
+  BatchSpool spool(dir);
+  EXPECT(spool.open().isSuccess());
+
+  /* partial writes and other hidden files */
+  touch(dir + "/.1-1-0.5.batch.tmp", "x");
+  touch(dir + "/.2-1-0.5.batch", "x");
+
+  /* malformed names */
+  touch(dir + "/README", "x");
+  touch(dir + "/3-1-0.batch", "x");
+  touch(dir + "/4-1-0..batch", "x");
+  touch(dir + "/5-1-0.abc.batch", "x");
+  touch(dir + "/6-1-0.-5.batch", "x");
+  touch(dir + "/7-1-0.5.txt", "x");
+  touch(dir + "/8-1-0.5.batch.zstd.old", "x");
+
+  touch(dir + "/9-1-0.12.batch", "x");
+  touch(dir + "/9-1-1.34.batch.zstd", "x");
+
+  std::vector<BatchSpool::Entry> entries;
+  EXPECT(spool.list(&entries).isSuccess());
+  EXPECT(entries.size() == 2);
+  if (entries.size() == 2) {
+    EXPECT(entries[0].path == dir + "/9-1-0.12.batch");
+    EXPECT(entries[0].nrows == 12);
+    EXPECT(entries[0].content_encoding.empty());
+    EXPECT(entries[1].path == dir + "/9-1-1.34.batch.zstd");
+    EXPECT(entries[1].nrows == 34);
+    EXPECT(entries[1].content_encoding == "zstd");
+  }
+
+  removeDir(dir);
+}
+
+static void testOldestFirst(const std::string& base) {
+  auto dir = base + "/oldest_first";
+  BatchSpool spool(dir);
+  EXPECT(spool.open().isSuccess());
+
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < 5; ++i) {
+    std::string path;
+    EXPECT(spool.write(std::to_string(i), 1, "", &path).isSuccess());
+    paths.emplace_back(path);
+  }
+
+  /* left behind by an earlier run */
+  touch(dir + "/1000000000000000-1-0.1.batch", "old");
+
+  std::vector<BatchSpool::Entry> entries;
+  EXPECT(spool.list(&entries).isSuccess());
+  EXPECT(entries.size() == 6);
+  if (entries.size() == 6) {
+    EXPECT(entries[0].path == dir + "/1000000000000000-1-0.1.batch");
+    for (size_t i = 0; i < paths.size(); ++i) {
+      EXPECT(entries[i + 1].path == paths[i]);
+    }
+  }
+
+  removeDir(dir);
+}
+
+static void testOpen(const std::string& base) {
+  /* opening twice is fine */
+  BatchSpool spool(base + "/open");
+  EXPECT(spool.open().isSuccess());
+  EXPECT(spool.open().isSuccess());
+  removeDir(base + "/open");
+
+  touch(base + "/file", "x");
+  BatchSpool file_spool(base + "/file");
+  EXPECT(file_spool.open().isError());
+  unlink((base + "/file").c_str());
+
+  BatchSpool nested_spool(base + "/missing/spool");
+  EXPECT(nested_spool.open().isError());
+}
+
+int main(int argc, char** argv) {
+  char base[] = "/tmp/batch_spool_test.XXXXXX";
+  if (!mkdtemp(base)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  testRoundTrip(base);
+  testListParsing(base);
+  testOldestFirst(base);
+  testOpen(base);
+
+  rmdir(base);
+
+  if (num_failures > 0) {
+    fprintf(stderr, "%zu checks failed\n", num_failures);
+    return 1;
+  }
+
+  printf("all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,188 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <stdexcept>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "compressor.h"
+#include "util/stringutil.h"
+
+ReturnCode Compressor::fromString(
+    const std::string& spec,
+    std::unique_ptr<Compressor>* compressor) {
+  auto sep = spec.find(':');
+  auto method = spec.substr(0, sep);
+
+  int level = -1;
+  if (sep != std::string::npos) {
+    /* no level has more than two digits, longer ones would overflow stoi */
+    auto level_str = spec.substr(sep + 1);
+    if (level_str.empty() ||
+        level_str.size() > 2 ||
+        level_str.find_first_not_of("0123456789") != std::string::npos) {
+      return ReturnCode::error(
+          "EARG",
+          "invalid compression level: %s",
+          level_str.c_str());
+    }
+
+    level = std::stoi(level_str);
+  }
+
+  if (method == "gzip") {
+#ifdef HAVE_ZLIB
+    if (level == -1) {
+      level = GzipCompressor::kDefaultLevel;
+    }
+
+    if (level < 1 || level > 9) {
+      return ReturnCode::error(
+          "EARG",
+          "gzip compression level must be between 1 and 9");
+    }
+
+    compressor->reset(new GzipCompressor(level));
+    return ReturnCode::success();
+#else
+    return ReturnCode::error(
+        "EARG",
+        "gzip compression is not available (built without zlib)");
+#endif
+  }
+
+  if (method == "zstd") {
+#ifdef HAVE_ZSTD
+    if (level == -1) {
+      level = ZstdCompressor::kDefaultLevel;
+    }
+
+    if (level < 1 || level > ZSTD_maxCLevel()) {
+      return ReturnCode::error(
+          "EARG",
+          "zstd compression level must be between 1 and %i",
+          ZSTD_maxCLevel());
+    }
+
+    compressor->reset(new ZstdCompressor(level));
+    return ReturnCode::success();
+#else
+    return ReturnCode::error(
+        "EARG",
+        "zstd compression is not available (built without zstd)");
+#endif
+  }
+
+  return ReturnCode::error(
+      "EARG",
+      "invalid compression method: %s",
+      method.c_str());
+}
+
+#ifdef HAVE_ZLIB
+GzipCompressor::GzipCompressor(int level) : level_(level) {}
+
+const char* GzipCompressor::getContentEncoding() const {
+  return "gzip";
+}
+
+void GzipCompressor::compress(
+    const char* data,
+    size_t size,
+    std::string* out) const {
+  z_stream zs;
+  zs.zalloc = Z_NULL;
+  zs.zfree = Z_NULL;
+  zs.opaque = Z_NULL;
+
+  /* window bits + 16 writes a gzip header and trailer instead of zlib's */
+  auto rc = deflateInit2(
+      &zs,
+      level_,
+      Z_DEFLATED,
+      MAX_WBITS + 16,
+      8,
+      Z_DEFAULT_STRATEGY);
+
+  if (rc != Z_OK) {
+    throw std::runtime_error("deflateInit2() failed");
+  }
+
+  /* the bound does not include the gzip header on older zlib versions */
+  out->resize(deflateBound(&zs, size) + 32);
+  zs.next_in = (Bytef*) data;
+  zs.avail_in = size;
+  zs.next_out = (Bytef*) &(*out)[0];
+  zs.avail_out = out->size();
+
+  for (;;) {
+    rc = deflate(&zs, Z_FINISH);
+    if (rc == Z_STREAM_END) {
+      break;
+    }
+
+    if (rc != Z_OK && rc != Z_BUF_ERROR) {
+      deflateEnd(&zs);
+      throw std::runtime_error(
+          StringUtil::format("deflate() failed: $0", rc));
+    }
+
+    auto written = out->size() - zs.avail_out;
+    out->resize(out->size() * 2);
+    zs.next_out = (Bytef*) &(*out)[written];
+    zs.avail_out = out->size() - written;
+  }
+
+  out->resize(zs.total_out);
+  deflateEnd(&zs);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+ZstdCompressor::ZstdCompressor(int level) : level_(level) {}
+
+const char* ZstdCompressor::getContentEncoding() const {
+  return "zstd";
+}
+
+void ZstdCompressor::compress(
+    const char* data,
+    size_t size,
+    std::string* out) const {
+  out->resize(ZSTD_compressBound(size));
+
+  auto rc = ZSTD_compress(&(*out)[0], out->size(), data, size, level_);
+  if (ZSTD_isError(rc)) {
+    throw std::runtime_error(
+        StringUtil::format(
+            "ZSTD_compress() failed: $0",
+            ZSTD_getErrorName(rc)));
+  }
+
+  out->resize(rc);
+}
+#endif
+
@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <memory>
+#include <string>
+#include "util/return_code.h"
+
+/**
+ * Compresses request bodies before upload. Implementations must be safe to
+ * call from multiple threads at once.
+ */
+class Compressor {
+public:
+
+  /**
+   * Create a compressor from a --compress spec, e.g. "gzip", "gzip:9" or
+   * "zstd:3"
+   */
+  static ReturnCode fromString(
+      const std::string& spec,
+      std::unique_ptr<Compressor>* compressor);
+
+  virtual ~Compressor() = default;
+
+  /**
+   * The value of the Content-Encoding header for compressed bodies
+   */
+  virtual const char* getContentEncoding() const = 0;
+
+  /**
+   * Compress size bytes from data into out, replacing its contents
+   */
+  virtual void compress(
+      const char* data,
+      size_t size,
+      std::string* out) const = 0;
+
+};
+
+#ifdef HAVE_ZLIB
+class GzipCompressor : public Compressor {
+public:
+
+  static const int kDefaultLevel = 6;
+
+  GzipCompressor(int level);
+
+  const char* getContentEncoding() const override;
+  void compress(const char* data, size_t size, std::string* out) const override;
+
+protected:
+  int level_;
+};
+#endif
+
+#ifdef HAVE_ZSTD
+class ZstdCompressor : public Compressor {
+public:
+
+  static const int kDefaultLevel = 3;
+
+  ZstdCompressor(int level);
+
+  const char* getContentEncoding() const override;
+  void compress(const char* data, size_t size, std::string* out) const override;
+
+protected:
+  int level_;
+};
+#endif
+
@@ -0,0 +1,142 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "compressor.h"
+#include "util/stringutil.h"
+
+/**
+ * Compares the compression ratio and CPU time of the --compress methods on
+ * a batch of insert records.
+ *
+ *   compressor_benchmark [<rows per batch>]
+ *   compressor_benchmark <batch file>
+ *
+ * Generates a batch of the given number of rows, or reads the batch from a
+ * file (e.g. a spooled batch). Compressed batches are never coalesced, so
+ * the default matches the default --batch_size
+ */
+
+static const size_t kDefaultRowsPerBatch = 128;
+
+/* each method compresses the batch repeatedly for at least this long */
+static const double kMinBenchmarkSeconds = 2.0;
+
+static std::string generateBatch(size_t nrows) {
+  static const char* const kCountries[] = { "DE", "US", "FR", "GB", "JP" };
+  static const char* const kPaths[] = {
+    "/", "/pricing", "/docs/getting-started", "/blog/2016/06/release", "/login"
+  };
+
+  std::mt19937 prng(42);
+  std::string batch = "[";
+  for (size_t i = 0; i < nrows; ++i) {
+    if (i > 0) {
+      batch += ",";
+    }
+
+    batch += StringUtil::format(
+        R"({"database": "analytics", "table": "pageviews", "data": {)"
+        R"("id": $0, "session_id": "$1", "time": "2016-06-$2 $3:$4:$5", )"
+        R"("path": "$6", "country": "$7", "load_time": $8, "bounce": $9}})",
+        1000000 + i,
+        StringUtil::toString(prng() % 100000000),
+        10 + prng() % 20,
+        10 + prng() % 14,
+        10 + prng() % 50,
+        10 + prng() % 50,
+        kPaths[prng() % 5],
+        kCountries[prng() % 5],
+        prng() % 3000,
+        prng() % 2);
+  }
+
+  batch += "]";
+  return batch;
+}
+
+int main(int argc, char** argv) {
+  std::string batch;
+  if (argc > 1 && !StringUtil::isDigitString(argv[1])) {
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file) {
+      fprintf(stderr, "can't open %s\n", argv[1]);
+      return 1;
+    }
+
+    std::stringstream buf;
+    buf << file.rdbuf();
+    batch = buf.str();
+  } else {
+    size_t nrows = argc > 1 ? std::stoul(argv[1]) : kDefaultRowsPerBatch;
+    batch = generateBatch(std::max(nrows, size_t(1)));
+  }
+
+  printf("batch size: %zu bytes\n", batch.size());
+
+  static const char* const kSpecs[] = {
+    "gzip:1", "gzip:6", "gzip:9",
+    "zstd:1", "zstd:3", "zstd:9", "zstd:19"
+  };
+
+  for (auto spec : kSpecs) {
+    std::unique_ptr<Compressor> compressor;
+    auto rc = Compressor::fromString(spec, &compressor);
+    if (!rc.isSuccess()) {
+      printf("%-8s %s\n", spec, rc.getMessage().c_str());
+      continue;
+    }
+
+    std::string out;
+    size_t bytes_out = 0;
+    size_t iterations = 0;
+    double secs = 0;
+    auto begin = std::chrono::steady_clock::now();
+    while (secs < kMinBenchmarkSeconds) {
+      compressor->compress(batch.data(), batch.size(), &out);
+      bytes_out += out.size();
+      ++iterations;
+
+      secs = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - begin).count();
+    }
+
+    auto bytes_in = double(batch.size()) * iterations;
+
+    printf(
+        "%-8s ratio %5.2f  %7.1f MB/s  %6.2f ms per batch\n",
+        spec,
+        bytes_in / bytes_out,
+        bytes_in / (1024 * 1024) / secs,
+        secs * 1000 / iterations);
+  }
+
+  return 0;
+}
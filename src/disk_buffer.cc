@@ -0,0 +1,259 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "disk_buffer.h"
+#include "util/stringutil.h"
+
+DiskBuffer::DiskBuffer(
+    const std::string& dir,
+    size_t segment_size) :
+    dir_(dir),
+    segment_size_(segment_size),
+    pending_seq_(0),
+    write_segment_(-1),
+    next_segment_(0),
+    bytes_(0),
+    closed_(false) {}
+
+DiskBuffer::~DiskBuffer() {
+  for (const auto& segment : segments_) {
+    ::close(segment.second.fd);
+    unlink(segment.second.path.c_str());
+  }
+}
+
+/* must be called with the lock held */
+ReturnCode DiskBuffer::openSegment() {
+  if (write_segment_ != size_t(-1)) {
+    segments_[write_segment_].sealed = true;
+    removeSegmentIfDone(write_segment_);
+  }
+
+  if (next_segment_ == 0) {
+    mkdir(dir_.c_str(), 0755); // may already exist
+  }
+
+  Segment segment;
+  segment.path = StringUtil::format(
+      "$0/$1-$2.segment",
+      dir_,
+      getpid(),
+      next_segment_);
+  segment.size = 0;
+  segment.num_batches = 0;
+  segment.num_read = 0;
+  segment.sealed = false;
+  segment.fd = open(
+      segment.path.c_str(),
+      O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+      0600);
+
+  if (segment.fd < 0) {
+    write_segment_ = -1;
+    return ReturnCode::error(
+        "EIO",
+        "can't open %s: %s",
+        segment.path.c_str(),
+        strerror(errno));
+  }
+
+  write_segment_ = next_segment_++;
+  segments_.emplace(write_segment_, segment);
+  return ReturnCode::success();
+}
+
+/* must be called with the lock held */
+void DiskBuffer::removeSegmentIfDone(size_t id) {
+  auto& segment = segments_[id];
+  if (!segment.sealed || segment.num_read < segment.num_batches) {
+    return;
+  }
+
+  ::close(segment.fd);
+  unlink(segment.path.c_str());
+  segments_.erase(id);
+}
+
+ReturnCode DiskBuffer::append(const std::string& data, size_t nrows) {
+  std::unique_lock<std::mutex> lk(mutex_);
+  if (closed_) {
+    return ReturnCode::error("EIO", "disk buffer is closed");
+  }
+
+  if (write_segment_ == size_t(-1) ||
+      (segments_[write_segment_].size > 0 &&
+       segments_[write_segment_].size + data.size() > segment_size_)) {
+    auto rc = openSegment();
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  /**
+   * Reserve the range. The reserved batch keeps the segment open until it is
+   * read or its write fails, so the fd stays valid without the lock
+   */
+  auto& segment = segments_[write_segment_];
+  auto fd = segment.fd;
+  auto path = segment.path;
+
+  PendingWrite write;
+  write.entry.segment = write_segment_;
+  write.entry.offset = segment.size;
+  write.entry.size = data.size();
+  write.entry.nrows = nrows;
+  write.done = false;
+  write.failed = false;
+  auto seq = pending_seq_ + pending_.size();
+  pending_.emplace_back(write);
+
+  segment.size += data.size();
+  ++segment.num_batches;
+  lk.unlock();
+
+  auto result = writeData(fd, path, data, write.entry.offset);
+
+  lk.lock();
+  auto& pending = pending_[seq - pending_seq_];
+  pending.done = true;
+  pending.failed = !result.isSuccess();
+  publishWrites();
+
+  lk.unlock();
+  cv_.notify_all();
+  return result;
+}
+
+ReturnCode DiskBuffer::writeData(
+    int fd,
+    const std::string& path,
+    const std::string& data,
+    size_t offset) {
+  for (size_t pos = 0; pos < data.size(); ) {
+    auto rc = pwrite(fd, data.data() + pos, data.size() - pos, offset + pos);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return ReturnCode::error(
+          "EIO",
+          "can't write %s: %s",
+          path.c_str(),
+          strerror(errno));
+    }
+
+    pos += rc;
+  }
+
+  return ReturnCode::success();
+}
+
+/* must be called with the lock held */
+void DiskBuffer::publishWrites() {
+  while (!pending_.empty() && pending_.front().done) {
+    const auto& write = pending_.front();
+    if (write.failed) {
+      --segments_[write.entry.segment].num_batches;
+      removeSegmentIfDone(write.entry.segment);
+    } else {
+      index_.emplace_back(write.entry);
+      bytes_ += write.entry.size;
+    }
+
+    pending_.pop_front();
+    ++pending_seq_;
+  }
+}
+
+ReturnCode DiskBuffer::read(std::string* data, size_t* nrows, bool* eof) {
+  std::unique_lock<std::mutex> lk(mutex_);
+
+  while (index_.empty() && (!closed_ || !pending_.empty())) {
+    cv_.wait(lk);
+  }
+
+  if (index_.empty()) {
+    *eof = true;
+    return ReturnCode::success();
+  }
+
+  auto entry = index_.front();
+  index_.pop_front();
+  auto fd = segments_[entry.segment].fd;
+  auto path = segments_[entry.segment].path;
+
+  /* the segment stays open until this batch is marked as read */
+  lk.unlock();
+
+  data->resize(entry.size);
+  ssize_t rc = 0;
+  for (size_t pos = 0; pos < entry.size; pos += rc) {
+    rc = pread(fd, &(*data)[pos], entry.size - pos, entry.offset + pos);
+    if (rc < 0 && errno == EINTR) {
+      rc = 0;
+      continue;
+    }
+
+    if (rc <= 0) {
+      return ReturnCode::error(
+          "EIO",
+          "can't read %s: %s",
+          path.c_str(),
+          rc < 0 ? strerror(errno) : "unexpected end of file");
+    }
+  }
+
+  lk.lock();
+  ++segments_[entry.segment].num_read;
+  bytes_ -= entry.size;
+  removeSegmentIfDone(entry.segment);
+
+  *nrows = entry.nrows;
+  *eof = false;
+  return ReturnCode::success();
+}
+
+void DiskBuffer::close() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  closed_ = true;
+  if (write_segment_ != size_t(-1)) {
+    segments_[write_segment_].sealed = true;
+    removeSegmentIfDone(write_segment_);
+    write_segment_ = -1;
+  }
+
+  lk.unlock();
+  cv_.notify_all();
+}
+
+size_t DiskBuffer::bytes() const {
+  std::unique_lock<std::mutex> lk(mutex_);
+  return bytes_;
+}
+
@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include "util/return_code.h"
+
+/**
+ * A disk-backed FIFO of encoded batches that sits between the mysql readers
+ * and the uploader, so reading never waits for the upload.
+ *
+ * Batches are appended to segment files of about segment_size bytes. An
+ * in-memory index records the segment, offset, size and row count of each
+ * batch and is only updated once the batch is completely written, so the
+ * reader never sees a partial batch. A segment file is removed as soon as
+ * it is full and all of its batches have been read.
+ *
+ * Appends only hold the lock to reserve a range in the current segment and
+ * to publish the index entry, so concurrent appends write in parallel. Index
+ * entries are published in the order the ranges were reserved; an entry
+ * waits until all earlier writes have completed or failed.
+ *
+ * The buffer does not survive a restart: segments left over from an earlier
+ * run are not read, and all segments are removed when the buffer is
+ * destroyed.
+ */
+class DiskBuffer {
+public:
+
+  DiskBuffer(const std::string& dir, size_t segment_size);
+  virtual ~DiskBuffer();
+
+  /**
+   * Append a batch. Safe to call from multiple threads
+   */
+  ReturnCode append(const std::string& data, size_t nrows);
+
+  /**
+   * Block until a batch is available or the buffer is closed. Sets eof to
+   * true instead of returning a batch once the buffer is closed and drained
+   */
+  ReturnCode read(std::string* data, size_t* nrows, bool* eof);
+
+  /**
+   * Close the buffer. The batches that were already appended can still be
+   * read
+   */
+  void close();
+
+  /**
+   * The number of bytes that were appended but not read yet
+   */
+  size_t bytes() const;
+
+protected:
+
+  struct Segment {
+    int fd;
+    std::string path;
+    size_t size;
+    size_t num_batches;
+    size_t num_read;
+    bool sealed;
+  };
+
+  struct IndexEntry {
+    size_t segment;
+    size_t offset;
+    size_t size;
+    size_t nrows;
+  };
+
+  struct PendingWrite {
+    IndexEntry entry;
+    bool done;
+    bool failed;
+  };
+
+  /**
+   * Write a batch to its reserved range. Called without the lock held
+   */
+  virtual ReturnCode writeData(
+      int fd,
+      const std::string& path,
+      const std::string& data,
+      size_t offset);
+
+  ReturnCode openSegment();
+  void removeSegmentIfDone(size_t segment);
+  void publishWrites();
+
+  std::string dir_;
+  size_t segment_size_;
+  std::map<size_t, Segment> segments_;
+  std::deque<IndexEntry> index_;
+
+  /* appends in reservation order, starting at sequence number pending_seq_ */
+  std::deque<PendingWrite> pending_;
+  size_t pending_seq_;
+  size_t write_segment_;
+  size_t next_segment_;
+  size_t bytes_;
+  bool closed_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
@@ -0,0 +1,326 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "disk_buffer.h"
+
+/**
+ * Checks the ordering, failure handling, eof and segment cleanup of
+ * DiskBuffer. Exits with a non-zero status if any check fails
+ */
+
+#define EXPECT(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      ++num_failures; \
+    } \
+  } while (0)
+
+static std::atomic<size_t> num_failures(0);
+
+/* long enough for a blocked thread to have returned if it was not blocked */
+static const auto kBlockWait = std::chrono::milliseconds(100);
+
+/**
+ * Holds writes of batches starting with "hold" until released and fails
+ * writes of batches containing "fail"
+ */
+class TestDiskBuffer : public DiskBuffer {
+public:
+
+  TestDiskBuffer(const std::string& dir, size_t segment_size) :
+      DiskBuffer(dir, segment_size),
+      num_held_(0),
+      released_(false) {}
+
+  void waitHeld(size_t n) {
+    std::unique_lock<std::mutex> lk(test_mutex_);
+    while (num_held_ < n) {
+      test_cv_.wait(lk);
+    }
+  }
+
+  void release() {
+    std::unique_lock<std::mutex> lk(test_mutex_);
+    released_ = true;
+    lk.unlock();
+    test_cv_.notify_all();
+  }
+
+protected:
+
+  ReturnCode writeData(
+      int fd,
+      const std::string& path,
+      const std::string& data,
+      size_t offset) override {
+    if (data.compare(0, 4, "hold") == 0) {
+      std::unique_lock<std::mutex> lk(test_mutex_);
+      ++num_held_;
+      test_cv_.notify_all();
+      while (!released_) {
+        test_cv_.wait(lk);
+      }
+    }
+
+    if (data.find("fail") != std::string::npos) {
+      return ReturnCode::error("EIO", "injected write failure");
+    }
+
+    return DiskBuffer::writeData(fd, path, data, offset);
+  }
+
+  std::mutex test_mutex_;
+  std::condition_variable test_cv_;
+  size_t num_held_;
+  bool released_;
+};
+
+static size_t countFiles(const std::string& path) {
+  auto dir = opendir(path.c_str());
+  if (!dir) {
+    return 0;
+  }
+
+  size_t n = 0;
+  for (struct dirent* ent; (ent = readdir(dir)) != nullptr; ) {
+    std::string name(ent->d_name);
+    if (name != "." && name != "..") {
+      ++n;
+    }
+  }
+
+  closedir(dir);
+  return n;
+}
+
+static void testConcurrentWriters(const std::string& dir) {
+  static const size_t kNumWriters = 8;
+  static const size_t kBatchesPerWriter = 500;
+
+  /* small segments so that segments are opened and removed while writing */
+  std::unique_ptr<DiskBuffer> buffer(new DiskBuffer(dir, 256));
+
+  std::vector<size_t> next(kNumWriters, 0);
+  std::atomic<size_t> num_errors(0);
+  std::thread reader([&] {
+    for (;;) {
+      std::string data;
+      size_t nrows;
+      bool eof;
+      if (!buffer->read(&data, &nrows, &eof).isSuccess()) {
+        ++num_errors;
+        return;
+      }
+
+      if (eof) {
+        return;
+      }
+
+      unsigned writer;
+      unsigned seq;
+      if (sscanf(data.c_str(), "%u:%u", &writer, &seq) != 2 ||
+          writer >= kNumWriters ||
+          seq != next[writer] ||
+          nrows != seq) {
+        ++num_errors;
+        continue;
+      }
+
+      ++next[writer];
+    }
+  });
+
+  std::vector<std::thread> writers;
+  for (size_t i = 0; i < kNumWriters; ++i) {
+    writers.emplace_back([&buffer, &num_errors, i] {
+      for (size_t j = 0; j < kBatchesPerWriter; ++j) {
+        /* vary the size so that batches straddle segment boundaries */
+        auto data = std::to_string(i) + ":" + std::to_string(j);
+        data += std::string(j % 64, ' ');
+        if (!buffer->append(data, j).isSuccess()) {
+          ++num_errors;
+        }
+      }
+    });
+  }
+
+  for (auto& writer : writers) {
+    writer.join();
+  }
+
+  buffer->close();
+  reader.join();
+
+  EXPECT(num_errors == 0);
+  for (size_t i = 0; i < kNumWriters; ++i) {
+    EXPECT(next[i] == kBatchesPerWriter);
+  }
+
+  EXPECT(buffer->bytes() == 0);
+  EXPECT(countFiles(dir) == 0);
+}
+
+static void testFailedWriteInMiddle(const std::string& dir) {
+  std::unique_ptr<TestDiskBuffer> buffer(new TestDiskBuffer(dir, 1 << 20));
+
+  std::thread writer([&buffer] {
+    EXPECT(buffer->append("hold-a", 1).isSuccess());
+  });
+
+  buffer->waitHeld(1);
+  EXPECT(!buffer->append("fail-b", 2).isSuccess());
+  EXPECT(buffer->append("c", 3).isSuccess());
+
+  /* nothing is published while the first write is pending */
+  EXPECT(buffer->bytes() == 0);
+  EXPECT(countFiles(dir) == 1);
+
+  buffer->close();
+  buffer->release();
+  writer.join();
+  EXPECT(buffer->bytes() == 7);
+
+  std::string data;
+  size_t nrows;
+  bool eof;
+  EXPECT(buffer->read(&data, &nrows, &eof).isSuccess());
+  EXPECT(!eof && data == "hold-a" && nrows == 1);
+  EXPECT(buffer->read(&data, &nrows, &eof).isSuccess());
+  EXPECT(!eof && data == "c" && nrows == 3);
+  EXPECT(buffer->read(&data, &nrows, &eof).isSuccess());
+  EXPECT(eof);
+
+  /* the failed batch does not keep the segment alive */
+  EXPECT(countFiles(dir) == 0);
+}
+
+static void testFailedWriteLast(const std::string& dir) {
+  std::unique_ptr<TestDiskBuffer> buffer(new TestDiskBuffer(dir, 1 << 20));
+  EXPECT(buffer->append("a", 1).isSuccess());
+
+  std::thread writer([&buffer] {
+    EXPECT(!buffer->append("hold-fail-b", 2).isSuccess());
+  });
+
+  buffer->waitHeld(1);
+
+  std::string data;
+  size_t nrows;
+  bool eof;
+  EXPECT(buffer->read(&data, &nrows, &eof).isSuccess());
+  EXPECT(!eof && data == "a");
+
+  /* all published batches are read, but the segment is still written to */
+  buffer->close();
+  EXPECT(countFiles(dir) == 1);
+
+  buffer->release();
+  writer.join();
+  EXPECT(countFiles(dir) == 0);
+
+  EXPECT(buffer->read(&data, &nrows, &eof).isSuccess());
+  EXPECT(eof);
+}
+
+static void testEofAfterPendingWrites(const std::string& dir) {
+  std::unique_ptr<TestDiskBuffer> buffer(new TestDiskBuffer(dir, 1 << 20));
+
+  std::thread writer([&buffer] {
+    EXPECT(buffer->append("hold-a", 1).isSuccess());
+  });
+
+  buffer->waitHeld(1);
+  buffer->close();
+
+  std::atomic<bool> returned(false);
+  std::string data;
+  size_t nrows;
+  bool eof = true;
+  std::thread reader([&] {
+    EXPECT(buffer->read(&data, &nrows, &eof).isSuccess());
+    returned = true;
+  });
+
+  std::this_thread::sleep_for(kBlockWait);
+  EXPECT(!returned);
+
+  buffer->release();
+  writer.join();
+  reader.join();
+  EXPECT(returned);
+  EXPECT(!eof && data == "hold-a");
+
+  EXPECT(buffer->read(&data, &nrows, &eof).isSuccess());
+  EXPECT(eof);
+  EXPECT(countFiles(dir) == 0);
+}
+
+static void testDestroyUnread(const std::string& dir) {
+  std::unique_ptr<DiskBuffer> buffer(new DiskBuffer(dir, 16));
+  for (size_t i = 0; i < 10; ++i) {
+    EXPECT(buffer->append(std::string(10, 'a'), 1).isSuccess());
+  }
+
+  EXPECT(countFiles(dir) == 10);
+  buffer.reset();
+  EXPECT(countFiles(dir) == 0);
+}
+
+int main(int argc, char** argv) {
+  char base[] = "/tmp/disk_buffer_test.XXXXXX";
+  if (!mkdtemp(base)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  std::string dir = std::string(base) + "/buffer";
+  testConcurrentWriters(dir);
+  testFailedWriteInMiddle(dir);
+  testFailedWriteLast(dir);
+  testEofAfterPendingWrites(dir);
+  testDestroyUnread(dir);
+
+  rmdir(dir.c_str());
+  rmdir(base);
+
+  if (num_failures > 0) {
+    fprintf(stderr, "%zu checks failed\n", num_failures.load());
+    return 1;
+  }
+
+  printf("all checks passed\n");
+  return 0;
+}
@@ -23,7 +23,10 @@
  * code of your own applications
  */
 #include <unistd.h>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <map>
 #include <thread>
 #include <curl/curl.h>
 #include "util/return_code.h"
@@ -32,22 +35,252 @@
 #include "util/mysql.h"
 #include "util/queue.h"
 #include "util/rate_limit.h"
+#include "batch_spool.h"
+#include "compressor.h"
+#include "disk_buffer.h"
+#include "row_encoder.h"
+#include "uploader.h"
 
-struct UploadShard {
-  std::string data;
-  size_t nrows;
-};
+static const size_t kBytesPerMegabyte = 1024 * 1024;
+
+/* inclusive [first, last] range of primary key values */
+typedef std::pair<int64_t, int64_t> PrimaryKeyRange;
+
+/* split the key range finer than the thread count so skew evens out */
+static const size_t kChunksPerSourceThread = 16;
+
+static bool isIntegerString(const std::string& str) {
+  if (str.empty()) {
+    return false;
+  }
+
+  auto begin = str.data();
+  if (*begin == '-') {
+    ++begin;
+  }
+
+  return begin < str.data() + str.size() &&
+      StringUtil::isDigitString(begin, str.data() + str.size());
+}
+
+/**
+ * Split the value range of the provided integer key column into up to
+ * num_chunks contiguous ranges. Returns false if the values do not fit into
+ * an int64. An empty table yields true and an empty range list.
+ */
+static bool splitPrimaryKeyRange(
+    MySQLConnection* conn,
+    const std::string& table,
+    const std::string& key_column,
+    const std::string& where_expr,
+    size_t num_chunks,
+    std::vector<PrimaryKeyRange>* ranges) {
+  /* MIN/MAX return NULL if no rows match */
+  size_t num_rows = 0;
+  bool is_empty = false;
+  std::string min_str;
+  std::string max_str;
+  conn->executeQuery(
+      StringUtil::format(
+          "SELECT MIN(`$0`), MAX(`$0`) FROM `$1` $2",
+          key_column,
+          table,
+          where_expr),
+      [&] (const MySQLRowView& row) -> bool {
+    if (++num_rows > 1 || row.size() != 2) {
+      return false;
+    }
+
+    if (row.isNull(0) || row.isNull(1)) {
+      is_empty = true;
+    } else {
+      min_str = row.getString(0);
+      max_str = row.getString(1);
+    }
+
+    return true;
+  });
+
+  if (num_rows != 1) {
+    return false;
+  }
+
+  if (is_empty) {
+    return true;
+  }
+
+  if (!isIntegerString(min_str) || !isIntegerString(max_str)) {
+    return false;
+  }
+
+  int64_t min;
+  int64_t max;
+  try {
+    min = std::stoll(min_str);
+    max = std::stoll(max_str);
+  } catch (const std::exception& e) {
+    return false; // BIGINT UNSIGNED beyond int64
+  }
+
+  uint64_t span = uint64_t(max) - uint64_t(min);
+  if (num_chunks == 0) {
+    num_chunks = 1;
+  }
+
+  uint64_t step = span / num_chunks + 1;
+  for (uint64_t offset = 0; ; offset += step) {
+    auto first = uint64_t(min) + offset;
+    if (span - offset < step) {
+      ranges->emplace_back(int64_t(first), max);
+      break;
+    }
+
+    ranges->emplace_back(int64_t(first), int64_t(first + step - 1));
+  }
+
+  return true;
+}
+
+/**
+ * Copy the primary key values of the provided row into key
+ */
+template <typename RowType>
+static void getRowKey(
+    const RowType& row,
+    const std::vector<size_t>& key_indexes,
+    std::vector<std::string>* key) {
+  key->clear();
+  for (auto idx : key_indexes) {
+    key->emplace_back(row.getString(idx));
+  }
+}
+
+/**
+ * Build the keyset condition that selects all rows strictly after the provided
+ * primary key value. MySQL does not range-scan a row constructor comparison
+ * like "(a, b) > (1, 'x')", so the comparison is expanded to
+ * "`a` >= 1 AND (`a` > 1 OR (`a` = 1 AND `b` > 'x'))", whose leading
+ * condition bounds the index range. A single column key yields "`a` > 1".
+ * Integer key values are not quoted so they are not compared as DOUBLE,
+ * which loses precision for BIGINT values above 2^53
+ */
+static std::string buildKeysetCondition(
+    MySQLConnection* conn,
+    const std::vector<MySQLColumnInfo>& table_columns,
+    const std::vector<size_t>& pk_indexes,
+    const std::vector<std::string>& last_key) {
+  std::vector<std::string> columns;
+  std::vector<std::string> values;
+  for (size_t i = 0; i < pk_indexes.size(); ++i) {
+    const auto& column = table_columns[pk_indexes[i]];
+    columns.emplace_back("`" + column.name + "`");
+    if (column.isInteger() && isIntegerString(last_key[i])) {
+      values.emplace_back(last_key[i]);
+    } else {
+      values.emplace_back("'" + conn->escapeString(last_key[i]) + "'");
+    }
+  }
+
+  /* built from the last key column outwards */
+  auto n = columns.size();
+  auto condition = columns[n - 1] + " > " + values[n - 1];
+  for (size_t i = n - 1; i-- > 0; ) {
+    condition = StringUtil::format(
+        "($0 > $1 OR ($0 = $1 AND $2))",
+        columns[i],
+        values[i],
+        condition);
+  }
+
+  if (n == 1) {
+    return condition;
+  }
+
+  return StringUtil::format(
+      "($0 >= $1 AND $2)",
+      columns[0],
+      values[0],
+      condition);
+}
+
+/**
+ * Build a where clause from the provided conditions, or an empty string if
+ * there are no conditions
+ */
+static std::string buildWhereClause(
+    const std::vector<std::string>& conditions) {
+  if (conditions.empty()) {
+    return "";
+  }
+
+  return " WHERE " + StringUtil::join(conditions, " AND ");
+}
+
+/**
+ * Build the uploader options that are shared by uploads and spool replays
+ */
+static UploaderOptions getUploaderOptions(const FlagParser& flags) {
+  UploaderOptions upload_opts;
+  for (const auto& arg : flags.getStrings("host")) {
+    for (auto& host : StringUtil::split(arg, ",")) {
+      if (host.empty()) {
+        continue;
+      }
+
+      if (host.find(':') == std::string::npos) {
+        host += ":" + StringUtil::toString(flags.getInt("port"));
+      }
+
+      upload_opts.hosts.emplace_back(host);
+    }
+  }
+
+  if (flags.isSet("auth_token")) {
+    upload_opts.auth_token = flags.getString("auth_token");
+  }
+
+  upload_opts.max_in_flight = flags.getInt("upload_threads");
+  upload_opts.adaptive_concurrency = flags.isSet("adaptive_uploads");
+  upload_opts.min_in_flight = flags.getInt("min_upload_threads");
+  upload_opts.coalesce_batches = std::max(
+      flags.getInt("coalesce_batches"),
+      int64_t(1));
+  upload_opts.max_retries = flags.getInt("max_retries");
+  upload_opts.retry_backoff_base_ms = flags.getInt("retry_backoff_ms");
+  upload_opts.retry_backoff_max_ms = flags.getInt("max_retry_backoff_ms");
+  upload_opts.retry_budget_percent = flags.getInt("retry_budget");
+  upload_opts.request_timeout_ms = flags.getInt("upload_timeout_ms");
+  return upload_opts;
+}
 
 bool run(const FlagParser& flags) {
   auto source_table = flags.getString("source_table");
   auto destination_table = flags.getString("destination_table");
   auto batch_size = flags.getInt("batch_size");
-  auto num_upload_threads = flags.getInt("upload_threads");
+  auto num_source_threads = flags.getInt("source_threads");
   auto mysql_addr = flags.getString("mysql");
-  auto host = flags.getString("host");
-  auto port = flags.getInt("port");
   auto db = flags.getString("database");
   auto max_retries = flags.getInt("max_retries");
+  size_t chunk_size = flags.getInt("chunk_size");
+  auto binary_protocol = flags.isSet("binary_protocol");
+
+  std::unique_ptr<Compressor> compressor;
+  if (flags.isSet("compress")) {
+    auto rc = Compressor::fromString(flags.getString("compress"), &compressor);
+    if (!rc.isSuccess()) {
+      logError(rc.getMessage());
+      return false;
+    }
+  }
+
+  /* fail before reading anything if failed batches could not be spooled */
+  if (flags.isSet("spool_dir")) {
+    auto rc = BatchSpool(flags.getString("spool_dir")).open();
+    if (!rc.isSuccess()) {
+      logError(rc.getMessage());
+      return false;
+    }
+  }
 
   logInfo("Connecting to MySQL Server...");
 
@@ -57,15 +290,131 @@ bool run(const FlagParser& flags) {
   logInfo(
       "Analyzing the input table. This might take a few minutes...");
 
-  auto column_names = mysql_conn->describeTable(source_table);
+  auto columns = mysql_conn->describeTable(source_table);
+
+  std::vector<std::string> column_names;
+  for (const auto& col : columns) {
+    column_names.emplace_back(col.name);
+  }
+
   logDebug("Table Columns: $0", StringUtil::join(column_names, ", "));
 
+  /* primary key columns in key order and their positions in the result rows */
+  std::vector<std::string> pk_columns;
+  std::vector<size_t> pk_indexes;
+  for (size_t i = 0; i < columns.size(); ++i) {
+    if (columns[i].primary_key_index < 0) {
+      continue;
+    }
+
+    size_t pos = columns[i].primary_key_index;
+    if (pk_columns.size() <= pos) {
+      pk_columns.resize(pos + 1);
+      pk_indexes.resize(pos + 1, -1);
+    }
+
+    pk_columns[pos] = columns[i].name;
+    pk_indexes[pos] = i;
+  }
+
+  logDebug("Primary Key: $0", StringUtil::join(pk_columns, ", "));
+
+  RowEncoder row_encoder(
+      columns,
+      db,
+      destination_table,
+      flags.isSet("omit_nulls"));
+
+  if (chunk_size > 0 &&
+      (pk_columns.empty() ||
+       std::count(pk_indexes.begin(), pk_indexes.end(), size_t(-1)) > 0)) {
+    logWarning(
+        "Table has no usable primary key, reading with a single query");
+    chunk_size = 0;
+  }
+
+  /* the user provided filter applies to all queries */
+  std::string where_expr;
+  std::vector<std::string> base_conditions;
+  if (flags.isSet("filter")) {
+    where_expr = "WHERE " + flags.getString("filter");
+    base_conditions.emplace_back("(" + flags.getString("filter") + ")");
+  }
+
+  /**
+   * Split the range of the leading primary key column if it is an integer.
+   * This runs before any thread is started, so an error simply aborts the run
+   */
+  std::vector<PrimaryKeyRange> pk_ranges;
+  bool parallel_read = false;
+  if (num_source_threads > 1) {
+    if (!pk_columns.empty() &&
+        pk_indexes[0] != size_t(-1) &&
+        columns[pk_indexes[0]].isInteger()) {
+      parallel_read = splitPrimaryKeyRange(
+          mysql_conn.get(),
+          source_table,
+          pk_columns[0],
+          where_expr,
+          num_source_threads * kChunksPerSourceThread,
+          &pk_ranges);
+    }
+
+    if (parallel_read) {
+      logInfo(
+          "Reading $0 primary key ranges on `$1` with $2 connections",
+          pk_ranges.size(),
+          pk_columns[0],
+          num_source_threads);
+    } else {
+      logWarning(
+          "Table has no integer primary key, falling back to a single reader");
+    }
+  }
+
+  /**
+   * The upload queue is bounded by the total size of the buffered batches,
+   * including the batches the uploader is sending or waiting to retry. Each
+   * reader also holds the batch it is currently encoding
+   */
+  Queue<UploadShard> upload_queue(
+      -1,
+      flags.getInt("max_buffered_mb") * kBytesPerMegabyte,
+      [] (const UploadShard& shard) { return shard.data.size(); });
+
+  /* optional disk buffer between the readers and the upload queue */
+  std::unique_ptr<DiskBuffer> disk_buffer;
+  if (flags.isSet("disk_buffer")) {
+    disk_buffer.reset(
+        new DiskBuffer(
+            flags.getString("disk_buffer"),
+            flags.getInt("disk_buffer_segment_mb") * kBytesPerMegabyte));
+  }
+
   /* status line */
   std::atomic<size_t> num_rows_uploaded(0);
+  std::atomic<size_t> num_bytes_encoded(0);
+  std::atomic<size_t> num_bytes_compressed(0);
   SimpleRateLimitedFn status_line(kMicrosPerSecond, [&] () {
-    logInfo(
-        "Uploading... $0 rows",
-        num_rows_uploaded.load());
+    auto status = StringUtil::format(
+        "Uploading... $0 rows, $1MB buffered",
+        num_rows_uploaded.load(),
+        upload_queue.bytes() / kBytesPerMegabyte);
+
+    if (disk_buffer) {
+      status += StringUtil::format(
+          ", $0MB on disk",
+          disk_buffer->bytes() / kBytesPerMegabyte);
+    }
+
+    if (compressor && num_bytes_compressed > 0) {
+      status += StringUtil::format(
+          ", compression ratio $0",
+          std::round(
+              10.0 * num_bytes_encoded / num_bytes_compressed) / 10.0);
+    }
+
+    logInfo(status);
   });
 
   ///* start upload threads */
@@ -82,193 +431,323 @@ bool run(const FlagParser& flags) {
   ////              cfg_.getUser() + ":" + cfg_.getPassword().get())));
   //}
 
-  auto insert_uri = StringUtil::format(
-      "http://$0:$1/api/v1/tables/insert",
-      host,
-      port);
+  auto upload_opts = getUploaderOptions(flags);
+  if (compressor) {
+    upload_opts.content_encoding = compressor->getContentEncoding();
+  }
+  if (flags.isSet("spool_dir")) {
+    upload_opts.spool_dir = flags.getString("spool_dir");
+  }
 
-  std::mutex upload_mutex;
-  bool upload_done = false;
+  /* a single thread drives all upload requests */
+  Uploader uploader(&upload_queue, upload_opts);
   std::atomic<bool> upload_error(false);
-  Queue<UploadShard> upload_queue(1);
-  std::list<std::thread> upload_threads;
-  for (size_t i = 0; i < num_upload_threads; ++i) {
-    auto t = std::thread([&] {
-      auto curl = curl_easy_init();
-      if (!curl) {
-        logError("curl_init() failed");
-        std::unique_lock<std::mutex> lk(upload_mutex);
+  std::thread upload_thread([&] {
+    if (!uploader.run()) {
+      upload_error = true;
+    }
+  });
+
+  /* moves batches from the disk buffer to the upload queue */
+  std::thread disk_buffer_thread;
+  if (disk_buffer) {
+    disk_buffer_thread = std::thread([&] {
+      for (;;) {
+        UploadShard shard;
+        bool eof = false;
+        auto rc = disk_buffer->read(&shard.data, &shard.nrows, &eof);
+        if (!rc.isSuccess()) {
+          logError(rc.getMessage());
+          upload_error = true;
+          upload_queue.closeWithError();
+          return;
+        }
+
+        if (eof || !upload_queue.insert(std::move(shard), true)) {
+          return;
+        }
+      }
+    });
+  }
+
+  /* fetch rows from mysql */
+  std::mutex status_mutex;
+  auto flush_shard = [&] (UploadShard* shard) {
+    if (upload_error || shard->nrows == 0) {
+      return;
+    }
+
+    auto nrows = shard->nrows;
+    auto capacity = shard->data.size();
+
+    /* compressed batches are queued as complete request bodies */
+    UploadShard compressed;
+    auto upload_shard = shard;
+    if (compressor) {
+      shard->data.push_back(']');
+      compressor->compress(
+          shard->data.data(),
+          shard->data.size(),
+          &compressed.data);
+
+      compressed.nrows = nrows;
+      num_bytes_encoded += shard->data.size();
+      num_bytes_compressed += compressed.data.size();
+      upload_shard = &compressed;
+    }
+
+    if (disk_buffer) {
+      auto rc = disk_buffer->append(upload_shard->data, nrows);
+      if (!rc.isSuccess()) {
+        logError(rc.getMessage());
         upload_error = true;
-        lk.unlock();
-        upload_queue.wakeup();
+        upload_queue.closeWithError();
         return;
       }
+    } else if (!upload_queue.insert(std::move(*upload_shard), true)) {
+      return; // closed with an error
+    }
 
-      for (;;) {
-        {
-          std::unique_lock<std::mutex> lk(upload_mutex);
-          if (upload_done || upload_error) {
-            break;
-          }
+    num_rows_uploaded += nrows;
+    shard->data.clear();
+    shard->data.reserve(capacity);
+    shard->nrows = 0;
+    if (compressor) {
+      shard->data.push_back('[');
+    }
+
+    std::unique_lock<std::mutex> lk(status_mutex);
+    status_line.runMaybe();
+  };
+
+  /* returns the number of rows read, records the key of the last row */
+  auto fetch_rows = [&] (
+      MySQLConnection* conn,
+      const std::string& query,
+      UploadShard* shard,
+      std::vector<std::string>* last_key) -> size_t {
+    size_t nrows = 0;
+    auto row_done = [&] () -> bool {
+      ++nrows;
+      if (shard->nrows == batch_size) {
+        flush_shard(shard);
+      }
+
+      return !upload_error;
+    };
+
+    if (binary_protocol) {
+      conn->executePreparedQuery(
+          query,
+          [&] (const MySQLBinaryRowView& row) -> bool {
+        if (++shard->nrows > 1) {
+          shard->data += ",";
         }
 
-        auto shard = upload_queue.interruptiblePop();
-        if (shard.isEmpty()) {
-          continue;
+        row_encoder.encodeRow(row, &shard->data);
+        if (last_key) {
+          getRowKey(row, pk_indexes, last_key);
         }
 
-        logDebug(
-            "Uploading batch; target=$0:$1 size=$2KB",
-            host,
-            port,
-            shard.get().data.size() / double(1000.0));
+        return row_done();
+      });
+    } else {
+      conn->executeQuery(
+          query,
+          [&] (const MySQLRowView& row) -> bool {
+        if (++shard->nrows > 1) {
+          shard->data += ",";
+        }
 
-        bool success = false;
-        for (size_t retry = 0; retry < max_retries; ++retry) {
-          sleep(std::min(retry, 5lu));
+        row_encoder.encodeRow(row, &shard->data);
+        if (last_key) {
+          getRowKey(row, pk_indexes, last_key);
+        }
 
-          auto http_url = StringUtil::format(
-              "http://$0:$1/api/v1/tables/insert",
-              host,
-              port);
+        return row_done();
+      });
+    }
 
-          logInfo(http_url);
-          std::string http_body = "[" + shard.get().data + "]";
+    return nrows;
+  };
+
+  /**
+   * Read all rows matching the provided conditions. With a chunk size, the
+   * rows are read in primary key order with one short query per chunk; a
+   * failed chunk is retried on a fresh connection, resuming after the last
+   * row that was read.
+   */
+  auto read_rows = [&] (
+      std::unique_ptr<MySQLConnection>* conn,
+      std::vector<std::string> conditions) {
+    UploadShard shard;
+    shard.nrows = 0;
+
+    /* the rows of a compressed batch are wrapped in [] by the reader */
+    if (compressor) {
+      shard.data.push_back('[');
+    }
 
-          struct curl_slist* req_headers = NULL;
-          req_headers = curl_slist_append(
-              req_headers,
-              "Content-Type: application/json; charset=utf-8");
+    if (chunk_size == 0) {
+      auto get_rows_qry = StringUtil::format(
+          "SELECT * FROM `$0`$1",
+          source_table,
+          buildWhereClause(conditions));
 
-          if (flags.isSet("auth_token")) {
-            auto hdr = "Authorization: Token " + flags.getString("auth_token");
-            req_headers = curl_slist_append(req_headers, hdr.c_str());
-          }
+      fetch_rows(conn->get(), get_rows_qry, &shard, nullptr);
+      flush_shard(&shard);
+      return;
+    }
 
-          //if (!username_.empty() || !password_.empty()) {
-          //  std::string hdr = "Authorization: Basic ";
-          //  hdr += Base64::encode(username_ + ":" + password_);
-          //  req_headers = curl_slist_append(req_headers, hdr.c_str());
-          //}
-
-          curl_easy_setopt(curl, CURLOPT_URL, http_url.c_str());
-          curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 5000);
-          curl_easy_setopt(curl, CURLOPT_POSTFIELDS, http_body.c_str());
-          curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req_headers);
-          CURLcode curl_res = curl_easy_perform(curl);
-          curl_slist_free_all(req_headers);
-          if (curl_res != CURLE_OK) {
-            logError("http request failed: $0", curl_easy_strerror(curl_res));
-            continue;
-          }
+    std::vector<std::string> order_columns;
+    for (const auto& pk_col : pk_columns) {
+      order_columns.emplace_back("`" + pk_col + "`");
+    }
 
-          long http_res_code = 0;
-          curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_res_code);
+    std::vector<std::string> last_key;
+    bool reconnect = false;
+    for (size_t retry = 0; !upload_error; ) {
+      try {
+        if (reconnect) {
+          *conn = MySQLConnection::openConnection(URI(mysql_addr));
+          reconnect = false;
+        }
 
-          switch (http_res_code) {
-            case 201:
-              success = true;
-              break;
-            default:
-              logError("http error: $0", http_res_code);
-              continue;
-          }
+        auto chunk_conditions = conditions;
+        if (!last_key.empty()) {
+          chunk_conditions.emplace_back(
+              buildKeysetCondition(
+                  conn->get(),
+                  columns,
+                  pk_indexes,
+                  last_key));
         }
 
-        if (!success) {
-          std::unique_lock<std::mutex> lk(upload_mutex);
-          upload_error = true;
-          lk.unlock();
-          upload_queue.wakeup();
+        auto get_rows_qry = StringUtil::format(
+            "SELECT * FROM `$0`$1 ORDER BY $2 LIMIT $3",
+            source_table,
+            buildWhereClause(chunk_conditions),
+            StringUtil::join(order_columns, ", "),
+            chunk_size);
+
+        auto nrows = fetch_rows(conn->get(), get_rows_qry, &shard, &last_key);
+        retry = 0;
+        if (nrows < chunk_size) {
+          break;
+        }
+      } catch (const std::exception& e) {
+        if (++retry > max_retries) {
+          throw;
         }
-      }
 
-      curl_easy_cleanup(curl); 
-    });
+        logWarning(
+            "mysql query failed, resuming after the last read row: $0",
+            e.what());
 
-    upload_threads.emplace_back(std::move(t));
-  }
+        sleep(std::min(retry, 5lu));
+        reconnect = true;
+      }
+    }
 
-  /* fetch rows from mysql */
-  UploadShard shard;
-  shard.nrows = 0;
+    flush_shard(&shard);
+  };
 
-  std::string where_expr;
-  if (flags.isSet("filter")) {
-    where_expr = "WHERE " + flags.getString("filter");
-  }
+  if (parallel_read) {
+    Queue<PrimaryKeyRange> range_queue;
+    for (const auto& r : pk_ranges) {
+      range_queue.insert(r);
+    }
 
-  try {
-    auto get_rows_qry = StringUtil::format(
-        "SELECT * FROM `$0` $1;",
-       source_table,
-       where_expr);
-
-    mysql_conn->executeQuery(
-        get_rows_qry,
-        [&] (const std::vector<std::string>& column_values) -> bool {
-      ++shard.nrows;
-
-      if (shard.nrows > 1) {
-        shard.data += ",";
+    std::vector<std::unique_ptr<MySQLConnection>> source_conns;
+    try {
+      for (size_t i = 0; i < num_source_threads; ++i) {
+        source_conns.emplace_back(
+            MySQLConnection::openConnection(URI(mysql_addr)));
       }
+    } catch (const std::exception& e) {
+      logError(
+          std::string("error while connecting to mysql: ") + e.what());
 
-      std::vector<std::string> fields;
-      for (size_t i = 0; i < column_names.size() && i < column_values.size(); ++i) {
-        fields.emplace_back(StringUtil::format(
-            R"("$0": "$1")",
-            StringUtil::jsonEscape(column_names[i]),
-            StringUtil::jsonEscape(column_values[i])));
-      }
+      upload_error = true;
+      upload_queue.closeWithError();
+      source_conns.clear();
+    }
 
-      shard.data += StringUtil::format(
-          R"({"database": "$0", "table": "$1", "data": {$2}})",
-          StringUtil::jsonEscape(db),
-          StringUtil::jsonEscape(destination_table),
-          StringUtil::join(fields, ","));
-
-      if (shard.nrows == batch_size) {
-        upload_queue.insert(shard, true);
-        num_rows_uploaded += shard.nrows;
-        shard.data.clear();
-        shard.nrows = 0;
-        status_line.runMaybe();
-      }
+    std::list<std::thread> source_threads;
+    for (auto& conn : source_conns) {
+      auto conn_ptr = &conn;
+      auto t = std::thread([&, conn_ptr] {
+        mysqlThreadInit();
 
-      return !upload_error;
-    });
-  } catch (const std::exception& e) {
-    logError(
-        std::string("error while executing mysql query: ") + e.what());
+        try {
+          while (!upload_error) {
+            auto range = range_queue.poll();
+            if (range.isEmpty()) {
+              break;
+            }
+
+            auto conditions = base_conditions;
+            conditions.emplace(
+                conditions.begin(),
+                StringUtil::format(
+                    "`$0` >= $1 AND `$0` <= $2",
+                    pk_columns[0],
+                    range.get().first,
+                    range.get().second));
+
+            read_rows(conn_ptr, conditions);
+          }
+        } catch (const std::exception& e) {
+          logError(
+              std::string("error while executing mysql query: ") + e.what());
 
-    std::unique_lock<std::mutex> lk(upload_mutex);
-    upload_error = true;
-    lk.unlock();
-    upload_queue.wakeup();
-  }
+          upload_error = true;
+          upload_queue.closeWithError();
+        }
 
-  if (!upload_error) {
-    if (shard.nrows > 0) {
-      upload_queue.insert(shard, true);
-      num_rows_uploaded += shard.nrows;
-      status_line.runMaybe();
+        mysqlThreadEnd();
+      });
+
+      source_threads.emplace_back(std::move(t));
     }
 
-    upload_queue.waitUntilEmpty();
+    for (auto& t : source_threads) {
+      t.join();
+    }
+  } else {
+    try {
+      read_rows(&mysql_conn, base_conditions);
+    } catch (const std::exception& e) {
+      logError(
+          std::string("error while executing mysql query: ") + e.what());
+
+      upload_error = true;
+      upload_queue.closeWithError();
+    }
   }
 
-  {
-    std::unique_lock<std::mutex> lk(upload_mutex);
-    upload_done = true;
+  if (disk_buffer) {
+    logInfo("Finished reading from mysql, draining the disk buffer...");
+    disk_buffer->close();
+    disk_buffer_thread.join();
   }
 
-  upload_queue.wakeup();
-  for (auto& t : upload_threads) {
-    t.join();
-  }
+  /* the uploader drains the remaining batches and exits */
+  upload_queue.close();
+  upload_thread.join();
 
   status_line.runForce();
 
+  if (uploader.getNumSpooledBatches() > 0) {
+    logWarning(
+        "$0 rows in $1 batches could not be uploaded and were spooled to $2, "
+        "upload them with --replay_spool $2",
+        uploader.getNumSpooledRows(),
+        uploader.getNumSpooledBatches(),
+        upload_opts.spool_dir);
+    upload_error = true;
+  }
+
   if (upload_error) {
     logInfo("Upload finished with errors");
     return false;
@@ -278,6 +757,89 @@ bool run(const FlagParser& flags) {
   }
 }
 
+/**
+ * Upload the batches from a spool directory and remove each spool file once
+ * its batch is uploaded
+ */
+bool replaySpool(const FlagParser& flags) {
+  auto spool_dir = flags.getString("replay_spool");
+
+  std::vector<BatchSpool::Entry> entries;
+  {
+    auto rc = BatchSpool(spool_dir).list(&entries);
+    if (!rc.isSuccess()) {
+      logError(rc.getMessage());
+      return false;
+    }
+  }
+
+  /* each content encoding is sent by its own uploader */
+  std::map<std::string, std::vector<BatchSpool::Entry>> entries_by_encoding;
+  for (const auto& entry : entries) {
+    entries_by_encoding[entry.content_encoding].emplace_back(entry);
+  }
+
+  logInfo("Replaying $0 batches from $1", entries.size(), spool_dir);
+
+  size_t num_rows_replayed = 0;
+  for (const auto& group : entries_by_encoding) {
+    Queue<UploadShard> upload_queue(
+        -1,
+        flags.getInt("max_buffered_mb") * kBytesPerMegabyte,
+        [] (const UploadShard& shard) { return shard.data.size(); });
+
+    SimpleRateLimitedFn status_line(kMicrosPerSecond, [&] () {
+      logInfo(
+          "Replaying... $0 rows, $1MB buffered",
+          num_rows_replayed,
+          upload_queue.bytes() / kBytesPerMegabyte);
+    });
+
+    auto upload_opts = getUploaderOptions(flags);
+    upload_opts.content_encoding = group.first;
+
+    Uploader uploader(&upload_queue, upload_opts);
+    std::atomic<bool> upload_error(false);
+    std::thread upload_thread([&] {
+      if (!uploader.run()) {
+        upload_error = true;
+      }
+    });
+
+    for (const auto& entry : group.second) {
+      UploadShard shard;
+      auto rc = BatchSpool::read(entry.path, &shard.data);
+      if (!rc.isSuccess()) {
+        logError(rc.getMessage());
+        upload_error = true;
+        upload_queue.closeWithError();
+        break;
+      }
+
+      shard.nrows = entry.nrows;
+      shard.spool_path = entry.path;
+      if (!upload_queue.insert(std::move(shard), true)) {
+        break; // closed with an error
+      }
+
+      num_rows_replayed += entry.nrows;
+      status_line.runMaybe();
+    }
+
+    upload_queue.close();
+    upload_thread.join();
+    status_line.runForce();
+
+    if (upload_error) {
+      logInfo("Replay finished with errors, the remaining batches were kept");
+      return false;
+    }
+  }
+
+  logInfo("Replay finished successfully :)");
+  return true;
+}
+
 int main(int argc, const char** argv) {
   FlagParser flags;
 
@@ -302,6 +864,34 @@ int main(int argc, const char** argv) {
       NULL,
       "INFO");
 
+  flags.defineFlag(
+      "log_to_syslog",
+      FlagParser::T_SWITCH,
+      false,
+      NULL,
+      NULL);
+
+  flags.defineFlag(
+      "nolog_to_syslog",
+      FlagParser::T_SWITCH,
+      false,
+      NULL,
+      NULL);
+
+  flags.defineFlag(
+      "log_to_stderr",
+      FlagParser::T_SWITCH,
+      false,
+      NULL,
+      NULL);
+
+  flags.defineFlag(
+      "nolog_to_stderr",
+      FlagParser::T_SWITCH,
+      false,
+      NULL,
+      NULL);
+
   flags.defineFlag(
       "source_table",
       FlagParser::T_STRING,
@@ -372,6 +962,55 @@ int main(int argc, const char** argv) {
       NULL,
       "8");
 
+  flags.defineFlag(
+      "binary_protocol",
+      FlagParser::T_SWITCH,
+      false,
+      NULL,
+      NULL);
+
+  flags.defineFlag(
+      "omit_nulls",
+      FlagParser::T_SWITCH,
+      false,
+      NULL,
+      NULL);
+
+  flags.defineFlag(
+      "chunk_size",
+      FlagParser::T_INTEGER,
+      false,
+      NULL,
+      "0");
+
+  flags.defineFlag(
+      "max_buffered_mb",
+      FlagParser::T_INTEGER,
+      false,
+      NULL,
+      "64");
+
+  flags.defineFlag(
+      "coalesce_batches",
+      FlagParser::T_INTEGER,
+      false,
+      NULL,
+      "8");
+
+  flags.defineFlag(
+      "compress",
+      FlagParser::T_STRING,
+      false,
+      NULL,
+      NULL);
+
+  flags.defineFlag(
+      "source_threads",
+      FlagParser::T_INTEGER,
+      false,
+      NULL,
+      "1");
+
   flags.defineFlag(
       "max_retries",
       FlagParser::T_INTEGER,
@@ -379,6 +1018,76 @@ int main(int argc, const char** argv) {
       NULL,
       "20");
 
+  flags.defineFlag(
+      "adaptive_uploads",
+      FlagParser::T_SWITCH,
+      false,
+      NULL,
+      NULL);
+
+  flags.defineFlag(
+      "min_upload_threads",
+      FlagParser::T_INTEGER,
+      false,
+      NULL,
+      "1");
+
+  flags.defineFlag(
+      "disk_buffer",
+      FlagParser::T_STRING,
+      false,
+      NULL,
+      NULL);
+
+  flags.defineFlag(
+      "disk_buffer_segment_mb",
+      FlagParser::T_INTEGER,
+      false,
+      NULL,
+      "64");
+
+  flags.defineFlag(
+      "spool_dir",
+      FlagParser::T_STRING,
+      false,
+      NULL,
+      NULL);
+
+  flags.defineFlag(
+      "replay_spool",
+      FlagParser::T_STRING,
+      false,
+      NULL,
+      NULL);
+
+  flags.defineFlag(
+      "retry_backoff_ms",
+      FlagParser::T_INTEGER,
+      false,
+      NULL,
+      "100");
+
+  flags.defineFlag(
+      "max_retry_backoff_ms",
+      FlagParser::T_INTEGER,
+      false,
+      NULL,
+      "10000");
+
+  flags.defineFlag(
+      "retry_budget",
+      FlagParser::T_INTEGER,
+      false,
+      NULL,
+      "20");
+
+  flags.defineFlag(
+      "upload_timeout_ms",
+      FlagParser::T_INTEGER,
+      false,
+      NULL,
+      "5000");
+
   /* parse flags */
   {
     auto rc = flags.parseArgv(argc, argv);
@@ -418,20 +1127,37 @@ int main(int argc, const char** argv) {
         "Usage: $ mysql2evql [OPTIONS]\n\n"
         "   --source_table <name>     \n"
         "   --destination_table <name>     \n"
-        "   --host <name>     \n"
-        "   --port <name>     \n"
+        "   --host <name>             EventQL host[:port]; repeat or separate with commas to balance over several hosts\n"
+        "   --port <name>             Port of hosts that are given without one (default: 9175)\n"
         "   --auth_token <name>     \n"
         "   --database <name>     \n"
         "   --mysql <name>     \n"
         "   --filter <name>     \n"
         "   --batch_size <name>     \n"
-        "   --upload_threads <name>     \n"
+        "   --upload_threads <num>    Maximum number of concurrent upload requests (default: 8)\n"
+        "   --adaptive_uploads        Adjust the number of concurrent upload requests to the observed latency and errors\n"
+        "   --min_upload_threads <num> Lower limit of concurrent upload requests with --adaptive_uploads (default: 1)\n"
+        "   --binary_protocol         Fetch rows with prepared statements and typed binding\n"
+        "   --omit_nulls              Leave NULL columns out of the record instead of writing null\n"
+        "   --chunk_size <num>        Read in primary key order with <num> rows per query (default: 0, a single query)\n"
+        "   --max_buffered_mb <num>   Encoded batches queued or in flight before reading blocks (default: 64)\n"
+        "   --coalesce_batches <num>  Send up to <num> buffered batches in one request (default: 8)\n"
+        "   --compress <method>       Compress request bodies: gzip[:<level>] or zstd[:<level>]\n"
+        "   --source_threads <num>    Read primary key ranges over <num> MySQL connections\n"
         "   --max_retries <name>     \n"
+        "   --retry_backoff_ms <num>  Base delay of the randomized exponential retry backoff (default: 100)\n"
+        "   --max_retry_backoff_ms <num> Maximum retry backoff delay (default: 10000)\n"
+        "   --retry_budget <pct>      Retries allowed across all uploads, in percent of requests (default: 20)\n"
+        "   --upload_timeout_ms <num> Upload request timeout, plus one second per MB of the body (default: 5000)\n"
+        "   --disk_buffer <path>      Buffer encoded batches in <path> so reading from mysql never waits for the upload\n"
+        "   --disk_buffer_segment_mb <num> Size of the disk buffer segment files (default: 64)\n"
+        "   --spool_dir <path>        Write batches that fail to upload to <path> and continue\n"
+        "   --replay_spool <path>     Upload the batches spooled to <path> instead of reading from mysql\n"
         "   --loglevel <level>        Minimum log level (default: INFO)\n"
         "   --[no]log_to_syslog       Do[n't] log to syslog\n"
         "   --[no]log_to_stderr       Do[n't] log to stderr\n"
         "   -?, --help                Display this help text and exit\n"
-        "   -v, --version             Display the version of this binary and exit\n"
+        "   -V, --version             Display the version of this binary and exit\n"
         "                                                        \n"
         "Examples:                                               \n"
         "   $ mysql2evql \\\n"
@@ -449,7 +1175,10 @@ int main(int argc, const char** argv) {
   curl_global_init(CURL_GLOBAL_DEFAULT);
 
   try {
-    if (run(flags)) {
+    auto success =
+        flags.isSet("replay_spool") ? replaySpool(flags) : run(flags);
+
+    if (success) {
       rc = 0;
     } else {
       rc = 1;
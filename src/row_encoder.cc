@@ -0,0 +1,157 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include "row_encoder.h"
+#include "util/stringutil.h"
+
+RowEncoder::RowEncoder(
+    const std::vector<MySQLColumnInfo>& columns,
+    const std::string& database,
+    const std::string& table,
+    bool omit_nulls) :
+    omit_nulls_(omit_nulls) {
+  record_prefix_ = StringUtil::format(
+      R"({"database": "$0", "table": "$1", "data": {)",
+      StringUtil::jsonEscape(database),
+      StringUtil::jsonEscape(table));
+
+  for (const auto& col : columns) {
+    field_prefixes_.emplace_back(
+        "\"" + StringUtil::jsonEscape(col.name) + "\": ");
+    encoders_.emplace_back(getFieldEncoder(col));
+  }
+}
+
+RowEncoder::FieldEncoder RowEncoder::getFieldEncoder(
+    const MySQLColumnInfo& column) {
+  /* BIT(1) values are a single raw byte */
+  if (column.type == MYSQL_TYPE_BIT && column.length == 1) {
+    return &RowEncoder::encodeBoolean;
+  }
+
+  /* zerofill values have leading zeros, which are not valid JSON numbers */
+  if (column.isNumeric() && !(column.flags & ZEROFILL_FLAG)) {
+    return &RowEncoder::encodeNumber;
+  }
+
+  if (column.isNumeric() || column.isTemporal()) {
+    return &RowEncoder::encodeUnescapedString;
+  }
+
+  return &RowEncoder::encodeString;
+}
+
+void RowEncoder::encodeBoolean(const char* data, size_t len, std::string* out) {
+  for (size_t i = 0; i < len; ++i) {
+    if (data[i] != 0) {
+      out->append("true", 4);
+      return;
+    }
+  }
+
+  out->append("false", 5);
+}
+
+void RowEncoder::encodeNumber(const char* data, size_t len, std::string* out) {
+  out->append(data, len);
+}
+
+void RowEncoder::encodeUnescapedString(
+    const char* data,
+    size_t len,
+    std::string* out) {
+  *out += '"';
+  out->append(data, len);
+  *out += '"';
+}
+
+void RowEncoder::encodeString(const char* data, size_t len, std::string* out) {
+  *out += '"';
+  StringUtil::jsonEscape(data, len, out);
+  *out += '"';
+}
+
+static const char* getValue(
+    const MySQLRowView& row,
+    size_t idx,
+    char* scratch,
+    size_t* len) {
+  *len = row.length(idx);
+  return row.data(idx);
+}
+
+static const char* getValue(
+    const MySQLBinaryRowView& row,
+    size_t idx,
+    char* scratch,
+    size_t* len) {
+  if (row.type(idx) == MySQLBinaryRowView::T_STRING) {
+    *len = row.length(idx);
+    return row.data(idx);
+  } else {
+    *len = row.formatValue(idx, scratch);
+    return scratch;
+  }
+}
+
+template <typename RowType>
+void RowEncoder::encodeRowImpl(const RowType& row, std::string* out) const {
+  char scratch[MySQLBinaryRowView::kMaxFormattedValueSize];
+
+  out->append(record_prefix_);
+
+  bool first_field = true;
+  for (size_t i = 0; i < field_prefixes_.size() && i < row.size(); ++i) {
+    if (row.isNull(i) && omit_nulls_) {
+      continue;
+    }
+
+    if (!first_field) {
+      *out += ',';
+    }
+
+    first_field = false;
+    out->append(field_prefixes_[i]);
+
+    if (row.isNull(i)) {
+      out->append("null", 4);
+    } else {
+      size_t len;
+      auto data = getValue(row, i, scratch, &len);
+      encoders_[i](data, len, out);
+    }
+  }
+
+  out->append("}}", 2);
+}
+
+void RowEncoder::encodeRow(const MySQLRowView& row, std::string* out) const {
+  encodeRowImpl(row, out);
+}
+
+void RowEncoder::encodeRow(
+    const MySQLBinaryRowView& row,
+    std::string* out) const {
+  encodeRowImpl(row, out);
+}
+
@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include "util/mysql.h"
+
+/**
+ * Encodes mysql result rows into EventQL insert records. The JSON encoding of
+ * each column is chosen once from its mysql type: numeric columns are written
+ * as raw JSON numbers, temporal columns as strings without escaping and all
+ * other columns as escaped strings. SQL NULL values are written as JSON null
+ * or omitted from the record.
+ *
+ * Records are written straight into the output buffer: the record envelope
+ * and the escaped `"column": ` prefixes are built once per table, so each
+ * field costs one prefix append plus the value and no temporaries.
+ */
+class RowEncoder {
+public:
+
+  /**
+   * Appends the JSON encoding of a single non-null value to out
+   */
+  typedef void (*FieldEncoder)(const char* data, size_t len, std::string* out);
+
+  /**
+   * Create a new row encoder
+   *
+   * @param columns the columns of the source table, in result row order
+   * @param database the destination database
+   * @param table the destination table
+   * @param omit_nulls if true, null values are omitted from the record
+   */
+  RowEncoder(
+      const std::vector<MySQLColumnInfo>& columns,
+      const std::string& database,
+      const std::string& table,
+      bool omit_nulls);
+
+  /**
+   * Append the insert record for the provided row to out
+   */
+  void encodeRow(const MySQLRowView& row, std::string* out) const;
+
+  /**
+   * Append the insert record for the provided row to out
+   */
+  void encodeRow(const MySQLBinaryRowView& row, std::string* out) const;
+
+  /**
+   * Returns the field encoder for a column of the provided type
+   */
+  static FieldEncoder getFieldEncoder(const MySQLColumnInfo& column);
+
+  static void encodeBoolean(const char* data, size_t len, std::string* out);
+  static void encodeNumber(const char* data, size_t len, std::string* out);
+  static void encodeUnescapedString(
+      const char* data,
+      size_t len,
+      std::string* out);
+  static void encodeString(const char* data, size_t len, std::string* out);
+
+protected:
+
+  template <typename RowType>
+  void encodeRowImpl(const RowType& row, std::string* out) const;
+
+  std::string record_prefix_;
+  std::vector<std::string> field_prefixes_;
+  std::vector<FieldEncoder> encoders_;
+  bool omit_nulls_;
+};
+
@@ -0,0 +1,651 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include "uploader.h"
+#include "util/logging.h"
+#include "util/stringutil.h"
+#include "util/time.h"
+
+/* upper bound for the body of a request built from coalesced batches */
+static const size_t kMaxCoalescedRequestBytes = 16 * 1024 * 1024;
+
+/* the retry budget starts with this many retries */
+static const double kMinRetryTokens = 10;
+
+/* unused retries do not accumulate beyond this */
+static const double kMaxRetryTokens = 1000;
+
+/* how often the queue is checked for new batches while requests are running */
+static const int kPollTimeoutMillis = 10;
+
+/* the request timeout grows with the body, so large requests are not cut off */
+static const uint64_t kRequestTimeoutMillisPerMegabyte = 1000;
+
+/* the concurrency limit is cut when the latency exceeds the baseline by this */
+static const double kLatencyTolerance = 2.0;
+
+/* factors applied to the concurrency limit on overload and high latency */
+static const double kOverloadDecrease = 0.5;
+static const double kLatencyDecrease = 0.9;
+
+/* the baseline latency is re-measured this often to follow slow drift */
+static const uint64_t kMinLatencyWindowMicros = 60 * kMicrosPerSecond;
+
+/* weight of a new sample in the moving average of the latency */
+static const double kLatencySmoothing = 0.1;
+
+/**
+ * Latencies are only compared between requests of a similar body size. Size
+ * class n holds bodies of [64KB * 2^(n-1), 64KB * 2^n), class 0 everything
+ * below 64KB
+ */
+static const size_t kLatencySizeClassBytes = 64 * 1024;
+static const size_t kLatencySizeClasses = 16;
+
+static size_t getLatencySizeClass(size_t body_size) {
+  size_t size_class = 0;
+  for (auto n = body_size / kLatencySizeClassBytes; n > 0; n >>= 1) {
+    ++size_class;
+  }
+
+  return std::min(size_class, kLatencySizeClasses - 1);
+}
+
+/* a host is ejected after this many failed requests in a row */
+static const size_t kHostMaxFailures = 3;
+
+/* ejection time of a host, doubled on each repeated ejection up to the max */
+static const uint64_t kHostEjectionMicros = 10 * kMicrosPerSecond;
+static const uint64_t kHostMaxEjectionMicros = 5 * kMicrosPerMinute;
+
+static size_t discardResponse(char* data, size_t size, size_t n, void* priv) {
+  return size * n;
+}
+
+Uploader::Uploader(
+    Queue<UploadShard>* queue,
+    const UploaderOptions& options) :
+    queue_(queue),
+    next_host_(0),
+    max_in_flight_(std::max(options.max_in_flight, size_t(1))),
+    adaptive_(options.adaptive_concurrency),
+    min_in_flight_(
+        std::min(std::max(options.min_in_flight, size_t(1)), max_in_flight_)),
+    in_flight_limit_(adaptive_ ? min_in_flight_ : max_in_flight_),
+    min_latency_(kLatencySizeClasses, 0),
+    min_latency_reset_at_(kLatencySizeClasses, 0),
+    avg_latency_(0),
+    avg_latency_ratio_(0),
+    last_decrease_at_(0),
+    encoded_(!options.content_encoding.empty()),
+    content_encoding_(options.content_encoding),
+    num_spooled_batches_(0),
+    num_spooled_rows_(0),
+    coalesce_batches_(
+        encoded_ ? 1 : std::max(options.coalesce_batches, size_t(1))),
+    max_retries_(options.max_retries),
+    retry_backoff_base_(options.retry_backoff_base_ms * kMicrosPerMilli),
+    retry_backoff_max_(options.retry_backoff_max_ms * kMicrosPerMilli),
+    retry_budget_ratio_(options.retry_budget_percent / 100.0),
+    retry_tokens_(kMinRetryTokens),
+    request_timeout_ms_(options.request_timeout_ms),
+    prng_(std::random_device()()),
+    multi_(curl_multi_init()),
+    headers_(nullptr),
+    num_in_flight_(0) {
+  if (!options.spool_dir.empty()) {
+    spool_.reset(new BatchSpool(options.spool_dir));
+  }
+
+  for (const auto& name : options.hosts) {
+    Host host;
+    host.name = name;
+    host.url = StringUtil::format("http://$0/api/v1/tables/insert", name);
+    host.num_in_flight = 0;
+    host.num_failures = 0;
+    host.num_ejections = 0;
+    host.ejected_until = 0;
+    hosts_.emplace_back(host);
+  }
+
+  headers_ = curl_slist_append(
+      headers_,
+      "Content-Type: application/json; charset=utf-8");
+
+  if (!options.auth_token.empty()) {
+    auto hdr = "Authorization: Token " + options.auth_token;
+    headers_ = curl_slist_append(headers_, hdr.c_str());
+  }
+
+  if (encoded_) {
+    auto hdr = "Content-Encoding: " + options.content_encoding;
+    headers_ = curl_slist_append(headers_, hdr.c_str());
+  }
+
+  /* options that are the same for every request are set once per handle */
+  for (size_t i = 0; i < max_in_flight_; ++i) {
+    auto handle = curl_easy_init();
+    if (!handle) {
+      break;
+    }
+
+    curl_easy_setopt(handle, CURLOPT_POST, 1L);
+    curl_easy_setopt(handle, CURLOPT_READFUNCTION, &Uploader::readBody);
+    curl_easy_setopt(handle, CURLOPT_SEEKFUNCTION, &Uploader::seekBody);
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers_);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &discardResponse);
+    idle_handles_.emplace_back(handle);
+  }
+}
+
+Uploader::~Uploader() {
+  abortRequests();
+
+  for (auto handle : idle_handles_) {
+    curl_easy_cleanup(handle);
+  }
+
+  curl_slist_free_all(headers_);
+
+  if (multi_) {
+    curl_multi_cleanup(multi_);
+  }
+}
+
+bool Uploader::run() {
+  if (hosts_.empty()) {
+    logError("no EventQL hosts configured");
+    queue_->closeWithError();
+    return false;
+  }
+
+  if (!multi_ || idle_handles_.size() < max_in_flight_) {
+    logError("curl_init() failed");
+    queue_->closeWithError();
+    return false;
+  }
+
+  for (;;) {
+    startRequests();
+
+    /* nothing running or waiting for a retry, block until the next batch */
+    if (requests_.empty()) {
+      auto shards = queue_->popBatch(
+          coalesce_batches_,
+          kMaxCoalescedRequestBytes,
+          true);
+
+      if (shards.empty()) {
+        return true; // queue closed and drained
+      }
+
+      addRequest(std::move(shards));
+      continue;
+    }
+
+    int num_running = 0;
+    auto rc = curl_multi_perform(multi_, &num_running);
+    if (rc != CURLM_OK) {
+      logError("curl_multi_perform() failed: $0", curl_multi_strerror(rc));
+      abortRequests();
+      queue_->closeWithError();
+      return false;
+    }
+
+    if (!finishRequests()) {
+      abortRequests();
+      queue_->closeWithError();
+      return false;
+    }
+
+    curl_multi_poll(multi_, NULL, 0, kPollTimeoutMillis, NULL);
+  }
+}
+
+void Uploader::startRequests() {
+  auto limit = getInFlightLimit();
+  auto now = MonotonicClock::now();
+  for (auto& request : requests_) {
+    if (num_in_flight_ >= limit) {
+      return;
+    }
+
+    if (!request.in_flight && request.retry_at <= now) {
+      startRequest(&request);
+    }
+  }
+
+  while (num_in_flight_ < limit) {
+    auto shards = queue_->pollBatch(
+        coalesce_batches_,
+        kMaxCoalescedRequestBytes,
+        true);
+
+    if (shards.empty()) {
+      return;
+    }
+
+    addRequest(std::move(shards));
+  }
+}
+
+void Uploader::addRequest(std::vector<UploadShard> shards) {
+  requests_.emplace_back();
+  auto& request = requests_.back();
+  request.host = nullptr;
+  request.handle = nullptr;
+  request.shards = std::move(shards);
+  request.body_size = 0;
+  request.body_piece = 0;
+  request.body_offset = 0;
+  request.nrows = 0;
+  request.attempt = 0;
+  request.retry_at = 0;
+  request.started_at = 0;
+  request.in_flight = false;
+
+  /* every new request earns a fraction of a retry */
+  retry_tokens_ = std::min(
+      retry_tokens_ + retry_budget_ratio_,
+      kMaxRetryTokens);
+
+  /* encoded batches are complete bodies, others are joined into an array */
+  if (!encoded_) {
+    request.body.emplace_back("[", 1);
+  }
+
+  for (size_t i = 0; i < request.shards.size(); ++i) {
+    const auto& shard = request.shards[i];
+    if (i > 0) {
+      request.body.emplace_back(",", 1);
+    }
+
+    request.body.emplace_back(shard.data.data(), shard.data.size());
+    request.nrows += shard.nrows;
+  }
+
+  if (!encoded_) {
+    request.body.emplace_back("]", 1);
+  }
+
+  for (const auto& piece : request.body) {
+    request.body_size += piece.second;
+  }
+
+  logDebug(
+      "Uploading batch; size=$0KB batches=$1",
+      request.body_size / double(1000.0),
+      request.shards.size());
+
+  startRequest(&request);
+}
+
+void Uploader::startRequest(Request* request) {
+  request->host = pickHost();
+  request->handle = idle_handles_.back();
+  idle_handles_.pop_back();
+
+  request->body_piece = 0;
+  request->body_offset = 0;
+
+  auto timeout_ms = request_timeout_ms_ +
+      request->body_size * kRequestTimeoutMillisPerMegabyte / (1024 * 1024);
+
+  /* the body, headers and urls are prepared once, a retry only resends */
+  auto handle = request->handle;
+  curl_easy_setopt(handle, CURLOPT_URL, request->host->url.c_str());
+  curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, long(timeout_ms));
+  curl_easy_setopt(
+      handle,
+      CURLOPT_POSTFIELDSIZE_LARGE,
+      curl_off_t(request->body_size));
+  curl_easy_setopt(handle, CURLOPT_READDATA, request);
+  curl_easy_setopt(handle, CURLOPT_SEEKDATA, request);
+  curl_easy_setopt(handle, CURLOPT_PRIVATE, request);
+  curl_multi_add_handle(multi_, handle);
+
+  request->started_at = MonotonicClock::now();
+  request->in_flight = true;
+  ++request->host->num_in_flight;
+  ++num_in_flight_;
+}
+
+bool Uploader::finishRequests() {
+  bool success = true;
+
+  CURLMsg* msg;
+  int num_msgs;
+  while ((msg = curl_multi_info_read(multi_, &num_msgs))) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+
+    auto handle = msg->easy_handle;
+    auto curl_res = msg->data.result;
+
+    char* priv = nullptr;
+    curl_easy_getinfo(handle, CURLINFO_PRIVATE, &priv);
+    auto request = reinterpret_cast<Request*>(priv);
+
+    long http_res_code = 0;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_res_code);
+
+    curl_multi_remove_handle(multi_, handle);
+    idle_handles_.emplace_back(handle);
+    request->handle = nullptr;
+    request->in_flight = false;
+    --request->host->num_in_flight;
+    --num_in_flight_;
+
+    auto overloaded =
+        curl_res != CURLE_OK ||
+        http_res_code >= 500 ||
+        http_res_code == 429;
+
+    updateHost(request->host, overloaded);
+
+    if (adaptive_) {
+      updateInFlightLimit(
+          overloaded,
+          MonotonicClock::now() - request->started_at,
+          request->body_size);
+    }
+
+    if (curl_res != CURLE_OK) {
+      logError(
+          "http request to $0 failed: $1",
+          request->host->name,
+          curl_easy_strerror(curl_res));
+    } else if (http_res_code == 201) {
+      for (const auto& shard : request->shards) {
+        if (!shard.spool_path.empty()) {
+          unlink(shard.spool_path.c_str());
+        }
+      }
+
+      removeRequest(request);
+      continue;
+    } else {
+      logError("http error from $0: $1", request->host->name, http_res_code);
+    }
+
+    if (!retryRequest(request) && !spoolRequest(request)) {
+      success = false;
+    }
+  }
+
+  return success;
+}
+
+bool Uploader::spoolRequest(Request* request) {
+  if (!spool_) {
+    return false;
+  }
+
+  std::string data;
+  for (size_t i = 0; i < request->shards.size(); ++i) {
+    if (i > 0) {
+      data.append(",");
+    }
+
+    data.append(request->shards[i].data);
+  }
+
+  std::string path;
+  auto rc = spool_->write(data, request->nrows, content_encoding_, &path);
+  if (!rc.isSuccess()) {
+    logError("can't spool failed batch: $0", rc.getMessage());
+    return false;
+  }
+
+  logWarning("Spooled failed batch of $0 rows to $1", request->nrows, path);
+  ++num_spooled_batches_;
+  num_spooled_rows_ += request->nrows;
+  removeRequest(request);
+  return true;
+}
+
+void Uploader::removeRequest(Request* request) {
+  queue_->release(request->shards);
+  requests_.remove_if([request] (const Request& r) {
+    return &r == request;
+  });
+}
+
+size_t Uploader::getNumSpooledBatches() const {
+  return num_spooled_batches_;
+}
+
+size_t Uploader::getNumSpooledRows() const {
+  return num_spooled_rows_;
+}
+
+bool Uploader::retryRequest(Request* request) {
+  if (++request->attempt >= max_retries_) {
+    logError("giving up on batch after $0 attempts", request->attempt);
+    return false;
+  }
+
+  if (retry_tokens_ < 1) {
+    logError("giving up on batch, retry budget exhausted");
+    return false;
+  }
+
+  retry_tokens_ -= 1;
+
+  /* full jitter: a random delay up to the exponentially growing cap */
+  auto cap = retry_backoff_base_;
+  for (size_t i = 1; i < request->attempt && cap < retry_backoff_max_; ++i) {
+    cap *= 2;
+  }
+
+  cap = std::min(cap, retry_backoff_max_);
+
+  std::uniform_int_distribution<uint64_t> delay(0, cap);
+  request->retry_at = MonotonicClock::now() + delay(prng_);
+  return true;
+}
+
+size_t Uploader::readBody(char* buf, size_t size, size_t n, void* priv) {
+  auto request = static_cast<Request*>(priv);
+  auto buf_len = size * n;
+
+  size_t len = 0;
+  while (len < buf_len && request->body_piece < request->body.size()) {
+    const auto& piece = request->body[request->body_piece];
+    auto chunk = std::min(piece.second - request->body_offset, buf_len - len);
+    memcpy(buf + len, piece.first + request->body_offset, chunk);
+    len += chunk;
+
+    request->body_offset += chunk;
+    if (request->body_offset == piece.second) {
+      ++request->body_piece;
+      request->body_offset = 0;
+    }
+  }
+
+  return len;
+}
+
+/* curl rewinds the body when it resends on a new connection */
+int Uploader::seekBody(void* priv, curl_off_t offset, int origin) {
+  auto request = static_cast<Request*>(priv);
+  if (origin != SEEK_SET ||
+      offset < 0 ||
+      size_t(offset) > request->body_size) {
+    return CURL_SEEKFUNC_CANTSEEK;
+  }
+
+  request->body_piece = 0;
+  request->body_offset = 0;
+
+  size_t remaining = offset;
+  while (remaining > 0) {
+    const auto& piece = request->body[request->body_piece];
+    if (remaining < piece.second) {
+      request->body_offset = remaining;
+      break;
+    }
+
+    remaining -= piece.second;
+    ++request->body_piece;
+  }
+
+  return CURL_SEEKFUNC_OK;
+}
+
+Uploader::Host* Uploader::pickHost() {
+  auto now = MonotonicClock::now();
+
+  /* least outstanding requests; ties are broken round robin */
+  Host* best = nullptr;
+  Host* best_ejected = nullptr;
+  for (size_t i = 0; i < hosts_.size(); ++i) {
+    auto host = &hosts_[(next_host_ + i) % hosts_.size()];
+    auto& candidate = host->ejected_until > now ? best_ejected : best;
+    if (!candidate || host->num_in_flight < candidate->num_in_flight) {
+      candidate = host;
+    }
+  }
+
+  next_host_ = (next_host_ + 1) % hosts_.size();
+
+  /* if every host is ejected, keep going rather than stalling */
+  return best ? best : best_ejected;
+}
+
+void Uploader::updateHost(Host* host, bool failed) {
+  if (!failed) {
+    host->num_failures = 0;
+    host->num_ejections = 0;
+    return;
+  }
+
+  if (++host->num_failures < kHostMaxFailures) {
+    return;
+  }
+
+  auto ejection = kHostEjectionMicros;
+  for (size_t i = 0; i < host->num_ejections; ++i) {
+    ejection = std::min(ejection * 2, kHostMaxEjectionMicros);
+  }
+
+  host->num_failures = 0;
+  ++host->num_ejections;
+  host->ejected_until = MonotonicClock::now() + ejection;
+
+  if (hosts_.size() > 1) {
+    logWarning(
+        "Ejecting host $0 for $1s after $2 failed requests",
+        host->name,
+        ejection / kMicrosPerSecond,
+        kHostMaxFailures);
+  }
+}
+
+size_t Uploader::getInFlightLimit() const {
+  return std::max(size_t(in_flight_limit_), min_in_flight_);
+}
+
+void Uploader::updateInFlightLimit(
+    bool overloaded,
+    uint64_t latency,
+    size_t body_size) {
+  auto now = MonotonicClock::now();
+
+  if (!overloaded) {
+    /* the baseline of each size class is the lowest recent latency */
+    auto size_class = getLatencySizeClass(body_size);
+    auto& min_latency = min_latency_[size_class];
+    if (min_latency == 0 ||
+        latency < min_latency ||
+        now >= min_latency_reset_at_[size_class]) {
+      min_latency = std::max(latency, uint64_t(1));
+    }
+
+    if (now >= min_latency_reset_at_[size_class]) {
+      min_latency_reset_at_[size_class] = now + kMinLatencyWindowMicros;
+    }
+
+    auto ratio = latency / double(min_latency);
+    if (avg_latency_ == 0) {
+      avg_latency_ = latency;
+      avg_latency_ratio_ = ratio;
+    } else {
+      avg_latency_ += kLatencySmoothing * (latency - avg_latency_);
+      avg_latency_ratio_ += kLatencySmoothing * (ratio - avg_latency_ratio_);
+    }
+  }
+
+  /* cut at most once per round trip */
+  auto factor = 1.0;
+  if (overloaded) {
+    factor = kOverloadDecrease;
+  } else if (avg_latency_ratio_ > kLatencyTolerance) {
+    factor = kLatencyDecrease;
+  }
+
+  auto prev_limit = getInFlightLimit();
+  if (factor < 1.0) {
+    if (now - last_decrease_at_ < avg_latency_) {
+      return;
+    }
+
+    last_decrease_at_ = now;
+    in_flight_limit_ = std::max(
+        in_flight_limit_ * factor,
+        double(min_in_flight_));
+  } else {
+    /* one more request per round trip of in_flight_limit_ requests */
+    in_flight_limit_ = std::min(
+        in_flight_limit_ + 1.0 / in_flight_limit_,
+        double(max_in_flight_));
+  }
+
+  if (getInFlightLimit() != prev_limit) {
+    logDebug(
+        "Upload concurrency limit changed from $0 to $1",
+        prev_limit,
+        getInFlightLimit());
+  }
+}
+
+void Uploader::abortRequests() {
+  for (auto& request : requests_) {
+    if (request.in_flight) {
+      --request.host->num_in_flight;
+      curl_multi_remove_handle(multi_, request.handle);
+      idle_handles_.emplace_back(request.handle);
+    }
+
+    queue_->release(request.shards);
+  }
+
+  requests_.clear();
+  num_in_flight_ = 0;
+}
+
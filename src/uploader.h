@@ -0,0 +1,229 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <list>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <curl/curl.h>
+#include "batch_spool.h"
+#include "util/queue.h"
+
+/**
+ * A batch of encoded insert records, joined with ','
+ */
+struct UploadShard {
+  std::string data;
+  size_t nrows;
+
+  /* the spool file of a replayed batch, removed once it is uploaded */
+  std::string spool_path;
+};
+
+struct UploaderOptions {
+
+  /* the EventQL servers as "host:port" */
+  std::vector<std::string> hosts;
+
+  /* the auth token to send or the empty string */
+  std::string auth_token;
+
+  /**
+   * The encoding of the queued batches or the empty string. Encoded batches
+   * are complete request bodies and are never coalesced
+   */
+  std::string content_encoding;
+
+  /* the maximum number of concurrent requests */
+  size_t max_in_flight;
+
+  /**
+   * If true, the number of concurrent requests is adjusted between
+   * min_in_flight and max_in_flight from the observed latency and errors
+   */
+  bool adaptive_concurrency;
+  size_t min_in_flight;
+
+  /* the maximum number of batches per request */
+  size_t coalesce_batches;
+
+  /* the maximum number of attempts per request */
+  size_t max_retries;
+
+  /**
+   * Retries are delayed by a random time between zero and
+   * min(retry_backoff_max_ms, retry_backoff_base_ms * 2 ^ (attempt - 1))
+   */
+  uint64_t retry_backoff_base_ms;
+  uint64_t retry_backoff_max_ms;
+
+  /**
+   * The number of retries allowed across all requests, in percent of the
+   * number of requests. A request that fails once the budget is spent is
+   * not retried
+   */
+  double retry_budget_percent;
+
+  /**
+   * The timeout of a request in milliseconds, plus one second per MB of the
+   * request body
+   */
+  uint64_t request_timeout_ms;
+
+  /**
+   * If set, batches that can not be uploaded are written to this directory
+   * instead of failing the upload
+   */
+  std::string spool_dir;
+
+};
+
+/**
+ * Uploads the batches from an upload queue to the EventQL insert API.
+ *
+ * A single thread drives all requests through one curl multi handle, so the
+ * number of concurrent (keep-alive) requests is not tied to the number of
+ * threads. Small batches that are already buffered are coalesced into one
+ * request. The request body is streamed from the queued batches, so the
+ * batches are never copied into a separate body buffer. Failed requests are
+ * retried after an exponential backoff with full jitter without blocking the
+ * other requests, as long as the process-wide retry budget allows it.
+ *
+ * Requests are spread over the configured hosts: each request (and each
+ * retry) goes to the host with the fewest outstanding requests. A host that
+ * fails several requests in a row is ejected for a while and re-admitted
+ * afterwards; the ejection time doubles each time it is ejected again
+ * without a success in between.
+ *
+ * With adaptive concurrency, the limit on concurrent requests follows AIMD:
+ * it grows by one per round trip while the latency stays close to the lowest
+ * recently observed latency of requests with a similar body size, and is cut
+ * when requests fail with a connection error or an overload response (5xx,
+ * 429) or the latency rises well above that baseline. At most one cut is made
+ * per round trip, so a burst of failures from the same window counts once.
+ */
+class Uploader {
+public:
+
+  /**
+   * Create a new uploader
+   *
+   * @param queue the queue to read batches from. The bytes of the batches
+   *   are held in the queue's byte budget until their request is finished
+   * @param options the uploader options
+   */
+  Uploader(Queue<UploadShard>* queue, const UploaderOptions& options);
+
+  ~Uploader();
+
+  /**
+   * Upload batches until the queue is closed and drained. Returns false if
+   * a request failed after max_retries attempts or with the retry budget
+   * spent and could not be spooled, in which case the queue is closed with
+   * an error
+   */
+  bool run();
+
+  size_t getNumSpooledBatches() const;
+  size_t getNumSpooledRows() const;
+
+protected:
+
+  struct Host {
+    std::string name;
+    std::string url;
+    size_t num_in_flight;
+    size_t num_failures;
+    size_t num_ejections;
+    uint64_t ejected_until;
+  };
+
+  struct Request {
+    Host* host;
+    CURL* handle;
+    std::vector<UploadShard> shards;
+    std::vector<std::pair<const char*, size_t>> body;
+    size_t body_size;
+    size_t body_piece;
+    size_t body_offset;
+    size_t nrows;
+    size_t attempt;
+    uint64_t retry_at;
+    uint64_t started_at;
+    bool in_flight;
+  };
+
+  static size_t readBody(char* buf, size_t size, size_t n, void* priv);
+  static int seekBody(void* priv, curl_off_t offset, int origin);
+
+  Host* pickHost();
+  void updateHost(Host* host, bool failed);
+  size_t getInFlightLimit() const;
+  void updateInFlightLimit(
+      bool overloaded,
+      uint64_t latency,
+      size_t body_size);
+
+  void startRequests();
+  void startRequest(Request* request);
+  void addRequest(std::vector<UploadShard> shards);
+  bool finishRequests();
+  bool retryRequest(Request* request);
+  bool spoolRequest(Request* request);
+  void removeRequest(Request* request);
+  void abortRequests();
+
+  Queue<UploadShard>* queue_;
+  std::vector<Host> hosts_;
+  size_t next_host_;
+  size_t max_in_flight_;
+  bool adaptive_;
+  size_t min_in_flight_;
+  double in_flight_limit_;
+  std::vector<uint64_t> min_latency_;
+  std::vector<uint64_t> min_latency_reset_at_;
+  double avg_latency_;
+  double avg_latency_ratio_;
+  uint64_t last_decrease_at_;
+  bool encoded_;
+  std::string content_encoding_;
+  std::unique_ptr<BatchSpool> spool_;
+  size_t num_spooled_batches_;
+  size_t num_spooled_rows_;
+  size_t coalesce_batches_;
+  size_t max_retries_;
+  uint64_t retry_backoff_base_;
+  uint64_t retry_backoff_max_;
+  double retry_budget_ratio_;
+  double retry_tokens_;
+  uint64_t request_timeout_ms_;
+  std::mt19937_64 prng_;
+  CURLM* multi_;
+  struct curl_slist* headers_;
+  std::list<Request> requests_;
+  std::vector<CURL*> idle_handles_;
+  size_t num_in_flight_;
+};
+
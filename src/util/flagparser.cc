@@ -152,7 +152,7 @@ ReturnCode FlagParser::parseArgv(const std::vector<std::string>& argv) {
         flag_ptr = &flag;
       }
 
-      else if (arg.size() == longopt_eq.size() &&
+      else if (arg.size() >= longopt_eq.size() &&
           arg.compare(0, longopt_eq.size(), longopt_eq) == 0) {
         flag_ptr = &flag;
         eq_len = longopt_eq.size();
@@ -178,6 +178,13 @@ ReturnCode FlagParser::parseArgv(const std::vector<std::string>& argv) {
     }
 
     if (flag_ptr == nullptr) {
+      if (arg[0] == '-' && !ignore_unknown_) {
+        return ReturnCode::error(
+            "FLAG_ERROR",
+            "unknown flag %s",
+            arg.c_str());
+      }
+
       argv_.push_back(arg);
     } else if (flag_ptr->type == T_SWITCH) {
       flag_ptr->values.emplace_back("true");
@@ -93,6 +93,9 @@ public:
    */
   const std::vector<std::string>& getArgv() const;
 
+  /**
+   * Pass unknown flags through to getArgv() instead of failing parseArgv()
+   */
   void ignoreUnknownFlags();
 
 protected:
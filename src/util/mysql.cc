@@ -23,7 +23,13 @@
  */
 #include "mysql.h"
 #include "logging.h"
+#include <algorithm>
 #include <mutex>
+#include <stdio.h>
+#include <string.h>
+
+/* initial buffer size for string columns, grown on truncation */
+static const unsigned long kInitialStringBufferSize = 1024;
 
 void mysqlInit() {
 #ifdef STX_ENABLE_MYSQL
@@ -39,6 +45,14 @@ void mysqlInit() {
 #endif
 }
 
+void mysqlThreadInit() {
+  mysql_thread_init();
+}
+
+void mysqlThreadEnd() {
+  mysql_thread_end();
+}
+
 std::unique_ptr<MySQLConnection> MySQLConnection::openConnection(
     const URI& uri) {
   std::unique_ptr<MySQLConnection> conn(new MySQLConnection());
@@ -140,9 +154,9 @@ void MySQLConnection::connect(
   }
 }
 
-std::vector<std::string> MySQLConnection::describeTable(
+std::vector<MySQLColumnInfo> MySQLConnection::describeTable(
     const std::string& table_name) {
-  std::vector<std::string> columns;
+  std::vector<MySQLColumnInfo> columns;
 
   MYSQL_RES* res = mysql_list_fields(mysql_, table_name.c_str(), NULL);
   if (res == nullptr) {
@@ -154,16 +168,85 @@ std::vector<std::string> MySQLConnection::describeTable(
   auto num_cols = mysql_num_fields(res);
   for (int i = 0; i < num_cols; ++i) {
     MYSQL_FIELD* col = mysql_fetch_field_direct(res, i);
-    columns.emplace_back(col->name);
+
+    MySQLColumnInfo info;
+    info.name = col->name;
+    info.type = col->type;
+    info.flags = col->flags;
+    info.length = col->length;
+    info.decimals = col->decimals;
+    info.charsetnr = col->charsetnr;
+    info.is_nullable = !(col->flags & NOT_NULL_FLAG);
+    info.primary_key_index = -1;
+    columns.emplace_back(info);
   }
 
   mysql_free_result(res);
+
+  auto pk = getPrimaryKey(table_name);
+  for (size_t i = 0; i < pk.size(); ++i) {
+    for (auto& col : columns) {
+      if (col.name == pk[i]) {
+        col.primary_key_index = i;
+      }
+    }
+  }
+
+  return columns;
+}
+
+std::vector<std::string> MySQLConnection::getPrimaryKey(
+    const std::string& table_name) {
+  std::vector<std::string> columns;
+
+  /**
+   * Column 4 is Column_name, rows are ordered by Seq_in_index. Other columns
+   * like Sub_part are NULL, so only column 4 is read
+   */
+  executeQuery(
+      StringUtil::format(
+          "SHOW KEYS FROM `$0` WHERE Key_name = 'PRIMARY'",
+          table_name),
+      [&columns] (const MySQLRowView& row) -> bool {
+    if (row.size() > 4 && !row.isNull(4)) {
+      columns.emplace_back(row.getString(4));
+    }
+
+    return true;
+  });
+
   return columns;
 }
 
+std::string MySQLConnection::escapeString(const std::string& str) {
+  std::string escaped(str.size() * 2 + 1, 0);
+  auto len = mysql_real_escape_string(
+      mysql_,
+      &escaped[0],
+      str.data(),
+      str.size());
+
+  escaped.resize(len);
+  return escaped;
+}
+
 void MySQLConnection::executeQuery(
     const std::string& query,
     std::function<bool (const std::vector<std::string>&)> row_callback) {
+  std::vector<std::string> row_vec;
+  executeQuery(query, [&row_vec, &row_callback] (const MySQLRowView& row) {
+    row_vec.clear();
+    for (size_t i = 0; i < row.size(); ++i) {
+      row_vec.emplace_back(row.getString(i));
+    }
+
+    return row_callback(row_vec);
+  });
+}
+
+void MySQLConnection::executeQuery(
+    const std::string& query,
+    std::function<bool (const MySQLRowView&)> row_callback) {
 #ifndef STX_NOTRACE
     logTrace("fnord.mysql", "Executing MySQL query: $0", query);
 #endif
@@ -180,6 +263,8 @@ void MySQLConnection::executeQuery(
         mysql_error(mysql_)));
   }
 
+  auto row_len = mysql_num_fields(result);
+
   MYSQL_ROW row;
   while ((row = mysql_fetch_row(result))) {
     auto col_lens = mysql_fetch_lengths(result);
@@ -187,17 +272,20 @@ void MySQLConnection::executeQuery(
       break;
     }
 
-    std::vector<std::string> row_vec;
-    auto row_len = mysql_num_fields(result);
-    for (int i = 0; i < row_len; ++i) {
-      row_vec.emplace_back(row[i], col_lens[i]);
-    }
-
-    if (!row_callback(row_vec)) {
+    if (!row_callback(MySQLRowView(row, col_lens, row_len))) {
       break;
     }
   }
 
+  /* mysql_fetch_row returns NULL both at the end and on a broken stream */
+  if (row == nullptr && mysql_errno(mysql_) != 0) {
+    mysql_free_result(result);
+    throw std::runtime_error(StringUtil::format(
+        "mysql query failed: $0 -- error: $1\n",
+        query.c_str(),
+        mysql_error(mysql_)));
+  }
+
   mysql_free_result(result);
 }
 
@@ -245,3 +333,266 @@ std::list<std::vector<std::string>> MySQLConnection::executeQuery(
   return result_rows;
 }
 
+
+bool MySQLColumnInfo::isInteger() const {
+  switch (type) {
+    case MYSQL_TYPE_TINY:
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_YEAR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool MySQLColumnInfo::isNumeric() const {
+  switch (type) {
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_NEWDECIMAL:
+    case MYSQL_TYPE_FLOAT:
+    case MYSQL_TYPE_DOUBLE:
+      return true;
+    default:
+      return isInteger();
+  }
+}
+
+bool MySQLColumnInfo::isTemporal() const {
+  switch (type) {
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_TIME:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_TIMESTAMP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+std::string MySQLBinaryRowView::getString(size_t idx) const {
+  const auto& col = (*columns_)[idx];
+  if (col.is_null) {
+    return std::string();
+  }
+
+  if (col.type == T_STRING) {
+    return std::string(col.buffer.data(), col.length);
+  }
+
+  char buf[kMaxFormattedValueSize];
+  return std::string(buf, formatValue(idx, buf));
+}
+
+size_t MySQLBinaryRowView::formatValue(size_t idx, char* buf) const {
+  const auto& col = (*columns_)[idx];
+  const size_t buf_len = kMaxFormattedValueSize;
+
+  int len = 0;
+  switch (col.type) {
+
+    case T_INT64:
+      len = snprintf(buf, buf_len, "%lld", (long long) col.int_value);
+      break;
+
+    case T_UINT64:
+      len = snprintf(buf, buf_len, "%llu", (unsigned long long) col.uint_value);
+      break;
+
+    case T_FLOAT:
+      len = snprintf(buf, buf_len, "%.6g", col.float_value);
+      if (strtof(buf, nullptr) != col.float_value) {
+        len = snprintf(buf, buf_len, "%.9g", col.float_value);
+      }
+      break;
+
+    case T_DOUBLE:
+      len = snprintf(buf, buf_len, "%.15g", col.double_value);
+      if (strtod(buf, nullptr) != col.double_value) {
+        len = snprintf(buf, buf_len, "%.17g", col.double_value);
+      }
+      break;
+
+    case T_TIME: {
+      const auto& t = col.time_value;
+      switch (col.field_type) {
+        case MYSQL_TYPE_DATE:
+          len = snprintf(buf, buf_len, "%04u-%02u-%02u",
+              t.year, t.month, t.day);
+          break;
+        case MYSQL_TYPE_TIME:
+          len = snprintf(buf, buf_len, "%s%02u:%02u:%02u",
+              t.neg ? "-" : "", t.hour, t.minute, t.second);
+          break;
+        default:
+          len = snprintf(buf, buf_len, "%04u-%02u-%02u %02u:%02u:%02u",
+              t.year, t.month, t.day, t.hour, t.minute, t.second);
+          break;
+      }
+
+      if (col.decimals > 0 && col.decimals <= 6) {
+        char frac[8];
+        snprintf(frac, sizeof(frac), "%06lu", (unsigned long) t.second_part);
+        len += snprintf(buf + len, buf_len - len, ".%.*s", (int) col.decimals, frac);
+      }
+
+      break;
+    }
+
+    case T_STRING:
+      break;
+
+  }
+
+  return len > 0 ? len : 0;
+}
+
+static void raiseStatementError(MYSQL_STMT* stmt, const std::string& query) {
+  throw std::runtime_error(StringUtil::format(
+      "mysql query failed: $0 -- error: $1\n",
+      query.c_str(),
+      mysql_stmt_error(stmt)));
+}
+
+void MySQLConnection::executePreparedQuery(
+    const std::string& query,
+    std::function<bool (const MySQLBinaryRowView&)> row_callback) {
+#ifndef STX_NOTRACE
+    logTrace("fnord.mysql", "Executing MySQL prepared query: $0", query);
+#endif
+
+  std::unique_ptr<MYSQL_STMT, decltype(&mysql_stmt_close)> stmt(
+      mysql_stmt_init(mysql_),
+      &mysql_stmt_close);
+
+  if (!stmt) {
+    throw std::runtime_error(StringUtil::format(
+        "mysql_stmt_init() failed: $0\n",
+        mysql_error(mysql_)));
+  }
+
+  if (mysql_stmt_prepare(stmt.get(), query.c_str(), query.size()) != 0) {
+    raiseStatementError(stmt.get(), query);
+  }
+
+  std::unique_ptr<MYSQL_RES, decltype(&mysql_free_result)> meta(
+      mysql_stmt_result_metadata(stmt.get()),
+      &mysql_free_result);
+
+  if (!meta) {
+    raiseStatementError(stmt.get(), query);
+  }
+
+  /* bind every column to a buffer of its native type */
+  auto num_cols = mysql_num_fields(meta.get());
+  std::vector<MySQLBinaryRowView::Column> columns(num_cols);
+  std::vector<MYSQL_BIND> binds(num_cols);
+  memset(binds.data(), 0, sizeof(MYSQL_BIND) * num_cols);
+
+  for (size_t i = 0; i < num_cols; ++i) {
+    auto field = mysql_fetch_field_direct(meta.get(), i);
+    auto& col = columns[i];
+    auto& bind = binds[i];
+    col.field_type = field->type;
+    col.decimals = field->decimals;
+    col.length = 0;
+    col.is_null = 0;
+    col.error = 0;
+    bind.length = &col.length;
+    bind.is_null = &col.is_null;
+    bind.error = &col.error;
+
+    switch (field->type) {
+
+      case MYSQL_TYPE_TINY:
+      case MYSQL_TYPE_SHORT:
+      case MYSQL_TYPE_INT24:
+      case MYSQL_TYPE_LONG:
+      case MYSQL_TYPE_LONGLONG:
+      case MYSQL_TYPE_YEAR:
+        if (field->flags & UNSIGNED_FLAG) {
+          col.type = MySQLBinaryRowView::T_UINT64;
+          bind.is_unsigned = 1;
+        } else {
+          col.type = MySQLBinaryRowView::T_INT64;
+        }
+        bind.buffer_type = MYSQL_TYPE_LONGLONG;
+        bind.buffer = &col.int_value;
+        break;
+
+      case MYSQL_TYPE_FLOAT:
+        col.type = MySQLBinaryRowView::T_FLOAT;
+        bind.buffer_type = MYSQL_TYPE_FLOAT;
+        bind.buffer = &col.float_value;
+        break;
+
+      case MYSQL_TYPE_DOUBLE:
+        col.type = MySQLBinaryRowView::T_DOUBLE;
+        bind.buffer_type = MYSQL_TYPE_DOUBLE;
+        bind.buffer = &col.double_value;
+        break;
+
+      case MYSQL_TYPE_DATE:
+      case MYSQL_TYPE_TIME:
+      case MYSQL_TYPE_DATETIME:
+      case MYSQL_TYPE_TIMESTAMP:
+        col.type = MySQLBinaryRowView::T_TIME;
+        bind.buffer_type = field->type;
+        bind.buffer = &col.time_value;
+        break;
+
+      default:
+        col.type = MySQLBinaryRowView::T_STRING;
+        col.buffer.resize(
+            std::max(1lu, std::min(field->length, kInitialStringBufferSize)));
+        bind.buffer_type = MYSQL_TYPE_STRING;
+        bind.buffer = col.buffer.data();
+        bind.buffer_length = col.buffer.size();
+        break;
+
+    }
+  }
+
+  if (mysql_stmt_execute(stmt.get()) != 0 ||
+      mysql_stmt_bind_result(stmt.get(), binds.data()) != 0) {
+    raiseStatementError(stmt.get(), query);
+  }
+
+  for (;;) {
+    auto rc = mysql_stmt_fetch(stmt.get());
+    if (rc == MYSQL_NO_DATA) {
+      break;
+    }
+
+    if (rc == 1) {
+      raiseStatementError(stmt.get(), query);
+    }
+
+    /* grow the buffers of truncated string columns and refetch them */
+    if (rc == MYSQL_DATA_TRUNCATED) {
+      for (size_t i = 0; i < num_cols; ++i) {
+        auto& col = columns[i];
+        if (!col.error || col.type != MySQLBinaryRowView::T_STRING) {
+          continue;
+        }
+
+        col.buffer.resize(col.length);
+        binds[i].buffer = col.buffer.data();
+        binds[i].buffer_length = col.buffer.size();
+        if (mysql_stmt_fetch_column(stmt.get(), &binds[i], i, 0) != 0) {
+          raiseStatementError(stmt.get(), query);
+        }
+      }
+
+      if (mysql_stmt_bind_result(stmt.get(), binds.data()) != 0) {
+        raiseStatementError(stmt.get(), query);
+      }
+    }
+
+    if (!row_callback(MySQLBinaryRowView(&columns))) {
+      break;
+    }
+  }
+}
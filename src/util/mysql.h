@@ -31,6 +31,235 @@
 
 void mysqlInit();
 
+/**
+ * Set up and release the mysql client's per-thread state. Must be called at
+ * the start and end of every thread other than the main thread that uses a
+ * mysql connection
+ */
+void mysqlThreadInit();
+void mysqlThreadEnd();
+
+/**
+ * A read-only view of a single result row. The column values point directly
+ * into the mysql client's row buffer and are only valid for the duration of
+ * the row callback that received the view
+ */
+class MySQLRowView {
+public:
+
+  MySQLRowView(
+      MYSQL_ROW row,
+      const unsigned long* lengths,
+      size_t num_columns) :
+      row_(row),
+      lengths_(lengths),
+      num_columns_(num_columns) {}
+
+  /**
+   * Returns the number of columns in the row
+   */
+  inline size_t size() const {
+    return num_columns_;
+  }
+
+  /**
+   * Returns a pointer to the value of the column at idx. The value is not
+   * null terminated. Returns nullptr for SQL NULL values
+   */
+  inline const char* data(size_t idx) const {
+    return row_[idx];
+  }
+
+  /**
+   * Returns the length in bytes of the value of the column at idx
+   */
+  inline size_t length(size_t idx) const {
+    return lengths_[idx];
+  }
+
+  /**
+   * Returns true if the value of the column at idx is SQL NULL
+   */
+  inline bool isNull(size_t idx) const {
+    return row_[idx] == nullptr;
+  }
+
+  /**
+   * Returns a copy of the value of the column at idx. Returns an empty string
+   * for SQL NULL values
+   */
+  inline std::string getString(size_t idx) const {
+    if (row_[idx] == nullptr) {
+      return std::string();
+    } else {
+      return std::string(row_[idx], lengths_[idx]);
+    }
+  }
+
+protected:
+  MYSQL_ROW row_;
+  const unsigned long* lengths_;
+  size_t num_columns_;
+};
+
+/**
+ * Describes a single column of a table
+ */
+struct MySQLColumnInfo {
+  std::string name;
+  enum_field_types type;
+  unsigned int flags;
+  unsigned long length;
+  unsigned int decimals;
+  unsigned int charsetnr;
+  bool is_nullable;
+
+  /* position of the column in the primary key or -1 if not part of it */
+  int primary_key_index;
+
+  /**
+   * Returns true for the integer types (TINYINT through BIGINT and YEAR)
+   */
+  bool isInteger() const;
+
+  /**
+   * Returns true for all numeric types including DECIMAL and floats
+   */
+  bool isNumeric() const;
+
+  /**
+   * Returns true for DATE, TIME, DATETIME and TIMESTAMP
+   */
+  bool isTemporal() const;
+};
+
+/* my_bool was replaced by bool in newer client libraries */
+typedef decltype(MYSQL_BIND::is_null_value) MySQLBool;
+
+/**
+ * A read-only view of a single result row fetched with the binary protocol.
+ * Numeric and temporal columns are decoded into native values by the mysql
+ * client; all other columns are exposed as raw bytes. The view (and all
+ * pointers obtained from it) are only valid for the duration of the row
+ * callback that received it
+ */
+class MySQLBinaryRowView {
+public:
+
+  enum kColumnType {
+    T_INT64,
+    T_UINT64,
+    T_FLOAT,
+    T_DOUBLE,
+    T_TIME,
+    T_STRING
+  };
+
+  struct Column {
+    kColumnType type;
+    enum_field_types field_type;
+    unsigned int decimals;
+    union {
+      int64_t int_value;
+      uint64_t uint_value;
+      float float_value;
+      double double_value;
+    };
+    MYSQL_TIME time_value;
+    std::vector<char> buffer;
+    unsigned long length;
+    MySQLBool is_null;
+    MySQLBool error;
+  };
+
+  MySQLBinaryRowView(const std::vector<Column>* columns) : columns_(columns) {}
+
+  /**
+   * Returns the number of columns in the row
+   */
+  inline size_t size() const {
+    return columns_->size();
+  }
+
+  /**
+   * Returns the type of the native value of the column at idx
+   */
+  inline kColumnType type(size_t idx) const {
+    return (*columns_)[idx].type;
+  }
+
+  /**
+   * Returns true if the value of the column at idx is SQL NULL
+   */
+  inline bool isNull(size_t idx) const {
+    return (*columns_)[idx].is_null;
+  }
+
+  /**
+   * Returns the value of a T_INT64 column
+   */
+  inline int64_t getInt64(size_t idx) const {
+    return (*columns_)[idx].int_value;
+  }
+
+  /**
+   * Returns the value of a T_UINT64 column
+   */
+  inline uint64_t getUInt64(size_t idx) const {
+    return (*columns_)[idx].uint_value;
+  }
+
+  /**
+   * Returns the value of a T_FLOAT or T_DOUBLE column
+   */
+  inline double getDouble(size_t idx) const {
+    const auto& col = (*columns_)[idx];
+    return col.type == T_FLOAT ? col.float_value : col.double_value;
+  }
+
+  /**
+   * Returns the value of a T_TIME column
+   */
+  inline const MYSQL_TIME& getTime(size_t idx) const {
+    return (*columns_)[idx].time_value;
+  }
+
+  /**
+   * Returns a pointer to the bytes of a T_STRING column. The value is not
+   * null terminated
+   */
+  inline const char* data(size_t idx) const {
+    return (*columns_)[idx].buffer.data();
+  }
+
+  /**
+   * Returns the length in bytes of a T_STRING column
+   */
+  inline size_t length(size_t idx) const {
+    return (*columns_)[idx].length;
+  }
+
+  /**
+   * Returns the value of the column at idx formatted the same way the text
+   * protocol would return it. Returns an empty string for SQL NULL values
+   */
+  std::string getString(size_t idx) const;
+
+  /**
+   * Format the native value of a non-null column that is not a T_STRING
+   * column into the provided buffer (which must hold at least
+   * kMaxFormattedValueSize bytes), without allocating
+   *
+   * @returns the number of bytes written, not including a null terminator
+   */
+  size_t formatValue(size_t idx, char* buf) const;
+
+  static const size_t kMaxFormattedValueSize = 64;
+
+protected:
+  const std::vector<Column>* columns_;
+};
+
 class MySQLConnection {
 public:
 
@@ -100,13 +329,33 @@ public:
       const std::string& password);
 
   /**
-   * Returns a list of all column names for the provided table name. May
-   * throw an exception (This does the equivalent to a DESCRIBE TABLE)
+   * Returns a list of all columns for the provided table name, including
+   * their type, flags, declared length, charset and primary key position.
+   * May throw an exception (This does the equivalent to a DESCRIBE TABLE)
    *
    * @param table_name the name of the table do describe
-   * @returns a list of all columns names of the table
+   * @returns a list of all columns of the table
+   */
+  std::vector<MySQLColumnInfo> describeTable(const std::string& table_name);
+
+  /**
+   * Returns the list of column names that make up the primary key of the
+   * provided table, in key order. Returns an empty list if the table has no
+   * primary key. May throw an exception
+   *
+   * @param table_name the name of the table
+   * @returns a list of all primary key column names of the table
+   */
+  std::vector<std::string> getPrimaryKey(const std::string& table_name);
+
+  /**
+   * Escape the provided string for use inside a quoted string literal in a
+   * mysql query, using the character set of the connection
+   *
+   * @param str the string to escape
+   * @returns the escaped string
    */
-  std::vector<std::string> describeTable(const std::string& table_name);
+  std::string escapeString(const std::string& str);
 
   /**
    * Execute a mysql query. The mysql query string must not include a terminal
@@ -127,6 +376,23 @@ public:
       const std::string& query,
       std::function<bool (const std::vector<std::string>&)> row_callback);
 
+  /**
+   * Execute a mysql query. The mysql query string must not include a terminal
+   * semicolon.
+   *
+   * Same as above, but the row callback receives a view into the mysql client
+   * row buffer instead of a copy of the row. The view (and all pointers
+   * obtained from it) are only valid until the callback returns.
+   *
+   * This method may throw an exception.
+   *
+   * @param query the mysql query string without a terminal semicolon
+   * @param row_callback the callback that should be called for every result row
+   */
+  void executeQuery(
+      const std::string& query,
+      std::function<bool (const MySQLRowView&)> row_callback);
+
   /**
    * Execute a mysql query. The mysql query string must not include a terminal
    * semicolon.
@@ -144,6 +410,25 @@ public:
    */
   std::list<std::vector<std::string>> executeQuery(const std::string& query);
 
+  /**
+   * Execute a mysql query as a prepared statement and fetch the result rows
+   * using the binary protocol. The mysql query string must not include a
+   * terminal semicolon.
+   *
+   * The server sends numeric and temporal values in their compact binary
+   * encoding, which are bound into typed buffers instead of being converted
+   * to decimal strings on both ends. The row callback semantics are the same
+   * as for executeQuery.
+   *
+   * This method may throw an exception.
+   *
+   * @param query the mysql query string without a terminal semicolon
+   * @param row_callback the callback that should be called for every result row
+   */
+  void executePreparedQuery(
+      const std::string& query,
+      std::function<bool (const MySQLBinaryRowView&)> row_callback);
+
 protected:
   MYSQL* mysql_;
 };
@@ -22,38 +22,108 @@
  * code of your own applications
  */
 #pragma once
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <list>
 #include <deque>
+#include <vector>
 #include "option.h"
 
 /**
  * A queue is threadsafe
+ *
+ * The queue can be bounded by the number of items, by the total byte size of
+ * the items (as reported by a size function) or both. A blocking insert waits
+ * until the new item fits into both limits; an item that is larger than the
+ * byte budget on its own is still accepted once the queue is empty (and no
+ * bytes are held, see below)
+ *
+ * A consumer can take items with hold = true if it keeps them in memory after
+ * they leave the queue, e.g. while they are being sent or retried. The bytes
+ * of held items keep counting against the byte budget until the consumer
+ * passes the items to release()
+ *
+ * A queue can be closed. After close(), inserts fail and consumers drain the
+ * remaining items before popBatch() returns an empty list. After
+ * closeWithError(), the remaining items are discarded and all blocked
+ * producers and consumers return immediately
  */
 template <typename T>
 class Queue {
 public:
 
   Queue(size_t max_size = -1);
+  Queue(
+      size_t max_size,
+      size_t max_bytes,
+      std::function<size_t (const T&)> byte_size_fn);
 
   bool insert(const T& job, bool block = false);
+  bool insert(T&& job, bool block = false);
   T pop();
   Option<T> interruptiblePop();
   Option<T> poll();
 
+  /**
+   * Block until at least one item is available or the queue is closed, then
+   * take up to max_items items (and, if the queue has a size function, up to
+   * max_bytes bytes) with a single lock acquisition. The first item is always
+   * taken, even if it exceeds max_bytes. Returns an empty list once the queue
+   * is closed and drained or was closed with an error. If hold is true, the
+   * bytes of the returned items are held until release() is called
+   */
+  std::vector<T> popBatch(
+      size_t max_items,
+      size_t max_bytes = -1,
+      bool hold = false);
+
+  /**
+   * Like popBatch() but returns an empty list instead of blocking if the
+   * queue is empty
+   */
+  std::vector<T> pollBatch(
+      size_t max_items,
+      size_t max_bytes = -1,
+      bool hold = false);
+
+  /**
+   * Stop counting the bytes of items that were taken with hold = true against
+   * the byte budget
+   */
+  void release(const std::vector<T>& items);
+
   size_t length() const;
+
+  /**
+   * Returns the byte size of the queued items plus the held bytes
+   */
+  size_t bytes() const;
   void wakeup();
 
+  void close();
+  void closeWithError();
+
   void waitUntilEmpty() const;
 
 protected:
+  bool hasCapacity(size_t bytes) const;
+  template <typename U>
+  bool insertImpl(U&& job, bool block);
+  T takeFront();
+  std::vector<T> takeBatch(size_t max_items, size_t max_bytes, bool hold);
+
   std::deque<T> queue_;
   mutable std::mutex mutex_;
   mutable std::condition_variable wakeup_;
   size_t max_size_;
   size_t length_;
+  size_t max_bytes_;
+  size_t bytes_;
+  size_t held_bytes_;
+  std::function<size_t (const T&)> byte_size_fn_;
+  bool closed_;
 };
 
 
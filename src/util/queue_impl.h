@@ -26,29 +26,89 @@ template <typename T>
 Queue<T>::Queue(
     size_t max_size /* = -1 */) :
     max_size_(max_size),
-    length_(0) {}
+    length_(0),
+    max_bytes_(-1),
+    bytes_(0),
+    held_bytes_(0),
+    closed_(false) {}
 
 template <typename T>
-bool Queue<T>::insert(const T& job, bool block /* = false */) {
-  std::unique_lock<std::mutex> lk(mutex_);
+Queue<T>::Queue(
+    size_t max_size,
+    size_t max_bytes,
+    std::function<size_t (const T&)> byte_size_fn) :
+    max_size_(max_size),
+    length_(0),
+    max_bytes_(max_bytes),
+    bytes_(0),
+    held_bytes_(0),
+    byte_size_fn_(byte_size_fn),
+    closed_(false) {}
+
+template <typename T>
+bool Queue<T>::hasCapacity(size_t bytes) const {
+  if (max_size_ != size_t(-1) && length_ >= max_size_) {
+    return false;
+  }
+
+  if (max_bytes_ != size_t(-1) &&
+      (length_ > 0 || held_bytes_ > 0) &&
+      bytes_ + held_bytes_ + bytes > max_bytes_) {
+    return false;
+  }
 
-  if (max_size_ != size_t(-1)) {
-    while (length_ >= max_size_) {
-      if (!block) {
-        return false;
-      }
+  return true;
+}
 
-      wakeup_.wait(lk);
+template <typename T>
+template <typename U>
+bool Queue<T>::insertImpl(U&& job, bool block) {
+  auto bytes = byte_size_fn_ ? byte_size_fn_(job) : 0;
+  std::unique_lock<std::mutex> lk(mutex_);
+
+  while (!closed_ && !hasCapacity(bytes)) {
+    if (!block) {
+      return false;
     }
+
+    wakeup_.wait(lk);
+  }
+
+  if (closed_) {
+    return false;
   }
 
-  queue_.emplace_back(job);
+  queue_.emplace_back(std::forward<U>(job));
   ++length_;
+  bytes_ += bytes;
   lk.unlock();
   wakeup_.notify_all();
   return true;
 }
 
+template <typename T>
+bool Queue<T>::insert(const T& job, bool block /* = false */) {
+  return insertImpl(job, block);
+}
+
+template <typename T>
+bool Queue<T>::insert(T&& job, bool block /* = false */) {
+  return insertImpl(std::move(job), block);
+}
+
+/* must be called with the lock held on a non-empty queue */
+template <typename T>
+T Queue<T>::takeFront() {
+  if (byte_size_fn_) {
+    bytes_ -= byte_size_fn_(queue_.front());
+  }
+
+  auto job = std::move(queue_.front());
+  queue_.pop_front();
+  --length_;
+  return job;
+}
+
 template <typename T>
 T Queue<T>::pop() {
   std::unique_lock<std::mutex> lk(mutex_);
@@ -57,9 +117,7 @@ T Queue<T>::pop() {
     wakeup_.wait(lk);
   }
 
-  auto job = queue_.front();
-  queue_.pop_front();
-  --length_;
+  auto job = takeFront();
   lk.unlock();
   wakeup_.notify_all();
   return job;
@@ -76,9 +134,7 @@ Option<T> Queue<T>::interruptiblePop() {
   if (queue_.size() == 0) {
     return None<T>();
   } else {
-    auto job = Some(queue_.front());
-    queue_.pop_front();
-    --length_;
+    Option<T> job(takeFront());
     lk.unlock();
     wakeup_.notify_all();
     return job;
@@ -92,26 +148,128 @@ Option<T> Queue<T>::poll() {
   if (queue_.size() == 0) {
     return None<T>();
   } else {
-    auto job = Some(queue_.front());
-    queue_.pop_front();
-    --length_;
+    Option<T> job(takeFront());
     lk.unlock();
     wakeup_.notify_all();
     return job;
   }
 }
 
+/* must be called with the lock held */
+template <typename T>
+std::vector<T> Queue<T>::takeBatch(
+    size_t max_items,
+    size_t max_bytes,
+    bool hold) {
+  std::vector<T> batch;
+  size_t batch_bytes = 0;
+  while (queue_.size() > 0 && batch.size() < max_items) {
+    auto bytes = byte_size_fn_ ? byte_size_fn_(queue_.front()) : 0;
+    if (!batch.empty() &&
+        max_bytes != size_t(-1) &&
+        batch_bytes + bytes > max_bytes) {
+      break;
+    }
+
+    batch_bytes += bytes;
+    batch.emplace_back(takeFront());
+  }
+
+  if (hold) {
+    held_bytes_ += batch_bytes;
+  }
+
+  return batch;
+}
+
+template <typename T>
+std::vector<T> Queue<T>::popBatch(
+    size_t max_items,
+    size_t max_bytes /* = -1 */,
+    bool hold /* = false */) {
+  std::unique_lock<std::mutex> lk(mutex_);
+
+  while (queue_.size() == 0 && !closed_) {
+    wakeup_.wait(lk);
+  }
+
+  auto batch = takeBatch(max_items, max_bytes, hold);
+  lk.unlock();
+  if (!batch.empty()) {
+    wakeup_.notify_all();
+  }
+
+  return batch;
+}
+
+template <typename T>
+std::vector<T> Queue<T>::pollBatch(
+    size_t max_items,
+    size_t max_bytes /* = -1 */,
+    bool hold /* = false */) {
+  std::unique_lock<std::mutex> lk(mutex_);
+  auto batch = takeBatch(max_items, max_bytes, hold);
+  lk.unlock();
+  if (!batch.empty()) {
+    wakeup_.notify_all();
+  }
+
+  return batch;
+}
+
+template <typename T>
+void Queue<T>::release(const std::vector<T>& items) {
+  if (!byte_size_fn_) {
+    return;
+  }
+
+  size_t bytes = 0;
+  for (const auto& item : items) {
+    bytes += byte_size_fn_(item);
+  }
+
+  std::unique_lock<std::mutex> lk(mutex_);
+  held_bytes_ -= std::min(bytes, held_bytes_);
+  lk.unlock();
+  wakeup_.notify_all();
+}
+
 template <typename T>
 size_t Queue<T>::length() const {
   std::unique_lock<std::mutex> lk(mutex_);
   return length_;
 }
 
+template <typename T>
+size_t Queue<T>::bytes() const {
+  std::unique_lock<std::mutex> lk(mutex_);
+  return bytes_ + held_bytes_;
+}
+
 template <typename T>
 void Queue<T>::wakeup() {
   wakeup_.notify_all();
 }
 
+template <typename T>
+void Queue<T>::close() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  closed_ = true;
+  lk.unlock();
+  wakeup_.notify_all();
+}
+
+template <typename T>
+void Queue<T>::closeWithError() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  closed_ = true;
+  queue_.clear();
+  length_ = 0;
+  bytes_ = 0;
+  lk.unlock();
+  wakeup_.notify_all();
+}
+
 template <typename T>
 void Queue<T>::waitUntilEmpty() const {
   std::unique_lock<std::mutex> lk(mutex_);
@@ -120,4 +278,3 @@ void Queue<T>::waitUntilEmpty() const {
     wakeup_.wait(lk);
   }
 }
-
@@ -0,0 +1,202 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "queue.h"
+
+/**
+ * Checks the byte budget, held bytes, batch limits and close semantics of
+ * Queue. Exits with a non-zero status if any check fails
+ */
+
+#define EXPECT(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      ++num_failures; \
+    } \
+  } while (0)
+
+static size_t num_failures = 0;
+
+/* long enough for a blocked thread to have returned if it was not blocked */
+static const auto kBlockWait = std::chrono::milliseconds(100);
+
+typedef Queue<std::string> StringQueue;
+
+static StringQueue* newQueue(size_t max_bytes) {
+  return new StringQueue(
+      -1,
+      max_bytes,
+      [] (const std::string& str) { return str.size(); });
+}
+
+static void testOversizeItem() {
+  std::unique_ptr<StringQueue> queue(newQueue(100));
+
+  /* accepted on its own, but nothing fits behind it */
+  EXPECT(queue->insert(std::string(200, 'a')));
+  EXPECT(!queue->insert(std::string(10, 'b')));
+  EXPECT(queue->bytes() == 200);
+
+  /* held bytes count like queued ones */
+  auto batch = queue->pollBatch(8, -1, true);
+  EXPECT(batch.size() == 1);
+  EXPECT(queue->length() == 0);
+  EXPECT(queue->bytes() == 200);
+  EXPECT(!queue->insert(std::string(200, 'c')));
+  EXPECT(!queue->insert(std::string(10, 'd')));
+
+  queue->release(batch);
+  EXPECT(queue->bytes() == 0);
+  EXPECT(queue->insert(std::string(200, 'e')));
+}
+
+static void testInsertBlockedByHeldBytes() {
+  std::unique_ptr<StringQueue> queue(newQueue(100));
+  EXPECT(queue->insert(std::string(60, 'a')));
+  auto batch = queue->popBatch(8, -1, true);
+  EXPECT(batch.size() == 1);
+
+  std::atomic<bool> inserted(false);
+  std::thread producer([&] {
+    EXPECT(queue->insert(std::string(60, 'b'), true));
+    inserted = true;
+  });
+
+  std::this_thread::sleep_for(kBlockWait);
+  EXPECT(!inserted);
+
+  queue->release(batch);
+  producer.join();
+  EXPECT(inserted);
+  EXPECT(queue->bytes() == 60);
+
+  /* items taken without hold release their bytes right away */
+  EXPECT(queue->pollBatch(8).size() == 1);
+  EXPECT(queue->bytes() == 0);
+}
+
+static void testBatchLimits() {
+  std::unique_ptr<StringQueue> queue(newQueue(-1));
+  for (int i = 0; i < 5; ++i) {
+    EXPECT(queue->insert(std::string(50, 'a' + i)));
+  }
+
+  /* the first item is taken even if it exceeds max_bytes */
+  auto batch = queue->pollBatch(8, 20);
+  EXPECT(batch.size() == 1 && batch[0][0] == 'a');
+
+  batch = queue->pollBatch(8, 120);
+  EXPECT(batch.size() == 2 && batch[0][0] == 'b' && batch[1][0] == 'c');
+
+  batch = queue->popBatch(1);
+  EXPECT(batch.size() == 1 && batch[0][0] == 'd');
+
+  EXPECT(queue->length() == 1);
+  EXPECT(queue->bytes() == 50);
+}
+
+static void testClose() {
+  std::unique_ptr<StringQueue> queue(newQueue(-1));
+  EXPECT(queue->insert("a"));
+  EXPECT(queue->insert("b"));
+  EXPECT(queue->insert("c"));
+
+  queue->close();
+  EXPECT(!queue->insert("d"));
+
+  /* the remaining items are drained before popBatch returns empty */
+  EXPECT(queue->popBatch(2).size() == 2);
+  EXPECT(queue->popBatch(2).size() == 1);
+  EXPECT(queue->popBatch(2).empty());
+  EXPECT(queue->popBatch(2).empty());
+}
+
+static void testCloseWakesConsumer() {
+  std::unique_ptr<StringQueue> queue(newQueue(-1));
+
+  std::atomic<bool> returned(false);
+  std::thread consumer([&] {
+    EXPECT(queue->popBatch(8).empty());
+    returned = true;
+  });
+
+  std::this_thread::sleep_for(kBlockWait);
+  EXPECT(!returned);
+
+  queue->close();
+  consumer.join();
+  EXPECT(returned);
+}
+
+static void testCloseWithError() {
+  std::unique_ptr<StringQueue> queue(newQueue(100));
+  EXPECT(queue->insert(std::string(100, 'a')));
+
+  std::atomic<size_t> num_returned(0);
+  std::vector<std::thread> producers;
+  for (int i = 0; i < 4; ++i) {
+    producers.emplace_back([&] {
+      EXPECT(!queue->insert(std::string(10, 'b'), true));
+      ++num_returned;
+    });
+  }
+
+  std::this_thread::sleep_for(kBlockWait);
+  EXPECT(num_returned == 0);
+
+  /* blocked producers fail and the queued items are discarded */
+  queue->closeWithError();
+  for (auto& t : producers) {
+    t.join();
+  }
+
+  EXPECT(num_returned == 4);
+  EXPECT(queue->length() == 0);
+  EXPECT(queue->popBatch(8).empty());
+  EXPECT(!queue->insert("c"));
+}
+
+int main(int argc, char** argv) {
+  testOversizeItem();
+  testInsertBlockedByHeldBytes();
+  testBatchLimits();
+  testClose();
+  testCloseWakesConsumer();
+  testCloseWithError();
+
+  if (num_failures > 0) {
+    fprintf(stderr, "%zu checks failed\n", num_failures);
+    return 1;
+  }
+
+  printf("all checks passed\n");
+  return 0;
+}
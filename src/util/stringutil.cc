@@ -22,6 +22,7 @@
  * code of your own applications
  */
 #include <string>
+#include <string.h>
 #include "stringutil.h"
 
 void StringUtil::toStringVImpl(std::vector<std::string>* target) {}
@@ -385,16 +386,62 @@ bool StringUtil::includesi(const std::string& str, const std::string& subject) {
 std::string StringUtil::formatv(
     const char* fmt,
     std::vector<std::string> values) {
-  std::string str = fmt;
+  return formatImpl(fmt, strlen(fmt), values.data(), values.size());
+}
+
+std::string StringUtil::formatv(
+    const std::string& fmt,
+    std::vector<std::string> values) {
+  return formatImpl(fmt.data(), fmt.size(), values.data(), values.size());
+}
+
+std::string StringUtil::formatImpl(
+    const char* fmt,
+    size_t fmt_len,
+    const std::string* args,
+    size_t nargs) {
+  size_t out_len = fmt_len;
+  for (size_t i = 0; i < nargs; ++i) {
+    out_len += args[i].size();
+  }
+
+  std::string out;
+  out.reserve(out_len);
+
+  auto cur = fmt;
+  auto end = fmt + fmt_len;
+  while (cur < end) {
+    auto dollar = (const char*) memchr(cur, '$', end - cur);
+    if (dollar == nullptr) {
+      out.append(cur, end - cur);
+      break;
+    }
 
-  for (int i = 0; i < values.size(); ++i) {
-    StringUtil::replaceAll(
-        &str,
-        "$" + std::to_string(i),
-        StringUtil::toString(values[i]));
+    out.append(cur, dollar - cur);
+    cur = dollar + 1;
+
+    /* take the longest run of digits that still names a value */
+    size_t argn = 0;
+    auto digits_end = cur;
+    for (auto d = cur; d < end && isdigit((unsigned char) *d); ++d) {
+      auto next = argn * 10 + (*d - '0');
+      if (next >= nargs) {
+        break;
+      }
+
+      argn = next;
+      digits_end = d + 1;
+    }
+
+    if (digits_end == cur) {
+      out += '$';
+    } else {
+      out += args[argn];
+      cur = digits_end;
+    }
   }
 
-  return str;
+  return out;
 }
 
 std::string StringUtil::stripShell(const std::string& str) {
@@ -409,118 +456,144 @@ std::string StringUtil::stripShell(const std::string& str) {
   return out;
 }
 
-std::string StringUtil::jsonEscape(const std::string& string) {
-  std::string new_str;
+/* escape sequences for the control characters 0x00 - 0x1f */
+static const char* const kJSONControlEscapes[32] = {
+  "\\u0000", "\\u0001", "\\u0002", "\\u0003",
+  "\\u0004", "\\u0005", "\\u0006", "\\u0007",
+  "\\b",     "\\t",     "\\n",     "\\u000b",
+  "\\f",     "\\r",     "\\u000e", "\\u000f",
+  "\\u0010", "\\u0011", "\\u0012", "\\u0013",
+  "\\u0014", "\\u0015", "\\u0016", "\\u0017",
+  "\\u0018", "\\u0019", "\\u001a", "\\u001b",
+  "\\u001c", "\\u001d", "\\u001e", "\\u001f"
+};
 
-  for (int i = 0; i < string.size(); ++i) {
-    switch (string.at(i)) {
-      case 0x00:
-        new_str += "\\u0000";
-        break;
-      case 0x01:
-        new_str += "\\u0001";
-        break;
-      case 0x02:
-        new_str += "\\u0002";
-        break;
-      case 0x03:
-        new_str += "\\u0003";
-        break;
-      case 0x04:
-        new_str += "\\u0004";
-        break;
-      case 0x05:
-        new_str += "\\u0005";
-        break;
-      case 0x06:
-        new_str += "\\u0006";
-        break;
-      case 0x07:
-        new_str += "\\u0007";
-        break;
-      case '\b':
-        new_str += "\\b";
-        break;
-      case '\t':
-        new_str += "\\t";
-        break;
-      case '\n':
-        new_str += "\\n";
-        break;
-      case 0x0b:
-        new_str += "\\u000b";
-        break;
-      case '\f':
-        new_str += "\\f";
-        break;
-      case '\r':
-        new_str += "\\r";
-        break;
-      case 0x0e:
-        new_str += "\\u000e";
-        break;
-      case 0x0f:
-        new_str += "\\u000f";
-        break;
-      case 0x10:
-        new_str += "\\u0010";
-        break;
-      case 0x11:
-        new_str += "\\u0011";
-        break;
-      case 0x12:
-        new_str += "\\u0012";
-        break;
-      case 0x13:
-        new_str += "\\u0013";
-        break;
-      case 0x14:
-        new_str += "\\u0014";
-        break;
-      case 0x15:
-        new_str += "\\u0015";
-        break;
-      case 0x16:
-        new_str += "\\u0016";
-        break;
-      case 0x17:
-        new_str += "\\u0017";
-        break;
-      case 0x18:
-        new_str += "\\u0018";
-        break;
-      case 0x19:
-        new_str += "\\u0019";
-        break;
-      case 0x1a:
-        new_str += "\\u001a";
-        break;
-      case 0x1b:
-        new_str += "\\u001b";
-        break;
-      case 0x1c:
-        new_str += "\\u001c";
-        break;
-      case 0x1d:
-        new_str += "\\u001d";
-        break;
-      case 0x1e:
-        new_str += "\\u001e";
-        break;
-      case 0x1f:
-        new_str += "\\u001f";
-        break;
-      case '"':
-        new_str += "\\\"";
-        break;
-      case '\\':
-        new_str += "\\\\";
-        break;
-      default:
-        new_str += string.at(i);
+static inline bool needsJSONEscape(unsigned char chr) {
+  return chr < 0x20 || chr == '"' || chr == '\\';
+}
+
+static inline void appendJSONEscape(unsigned char chr, std::string* out) {
+  switch (chr) {
+    case '"':
+      out->append("\\\"", 2);
+      break;
+    case '\\':
+      out->append("\\\\", 2);
+      break;
+    default:
+      out->append(kJSONControlEscapes[chr]);
+      break;
+  }
+}
+
+static const char* scanJSONEscapeScalar(const char* cur, const char* end) {
+  for (; cur < end; ++cur) {
+    if (needsJSONEscape(*cur)) {
+      break;
+    }
+  }
+
+  return cur;
+}
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define STRINGUTIL_HAVE_SSE2 1
+#include <emmintrin.h>
+
+static const char* scanJSONEscapeSSE2(const char* cur, const char* end) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control_max = _mm_set1_epi8(0x1f);
+
+  for (; end - cur >= 16; cur += 16) {
+    auto chunk = _mm_loadu_si128((const __m128i*) cur);
+    auto is_control = _mm_cmpeq_epi8(_mm_min_epu8(chunk, control_max), chunk);
+    auto mask = _mm_or_si128(
+        _mm_or_si128(
+            _mm_cmpeq_epi8(chunk, quote),
+            _mm_cmpeq_epi8(chunk, backslash)),
+        is_control);
+
+    auto bits = _mm_movemask_epi8(mask);
+    if (bits != 0) {
+      return cur + __builtin_ctz(bits);
+    }
+  }
+
+  return scanJSONEscapeScalar(cur, end);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define STRINGUTIL_HAVE_AVX2 1
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static const char* scanJSONEscapeAVX2(const char* cur, const char* end) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control_max = _mm256_set1_epi8(0x1f);
+
+  for (; end - cur >= 32; cur += 32) {
+    auto chunk = _mm256_loadu_si256((const __m256i*) cur);
+    auto is_control = _mm256_cmpeq_epi8(
+        _mm256_min_epu8(chunk, control_max),
+        chunk);
+    auto mask = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(chunk, quote),
+            _mm256_cmpeq_epi8(chunk, backslash)),
+        is_control);
+
+    auto bits = (uint32_t) _mm256_movemask_epi8(mask);
+    if (bits != 0) {
+      return cur + __builtin_ctz(bits);
     }
   }
 
+  return scanJSONEscapeSSE2(cur, end);
+}
+#endif
+#endif
+
+std::vector<std::pair<std::string, StringUtil::JSONEscapeScanFn>>
+    StringUtil::getJSONEscapeScanners() {
+  std::vector<std::pair<std::string, JSONEscapeScanFn>> scanners;
+  scanners.emplace_back("scalar", &scanJSONEscapeScalar);
+
+#ifdef STRINGUTIL_HAVE_SSE2
+  scanners.emplace_back("sse2", &scanJSONEscapeSSE2);
+#endif
+
+#ifdef STRINGUTIL_HAVE_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scanners.emplace_back("avx2", &scanJSONEscapeAVX2);
+  }
+#endif
+
+  return scanners;
+}
+
+std::string StringUtil::jsonEscape(const std::string& string) {
+  std::string new_str;
+  new_str.reserve(string.size());
+  jsonEscape(string.data(), string.size(), &new_str);
   return new_str;
 }
 
+void StringUtil::jsonEscape(const char* str, size_t len, std::string* out) {
+  static const JSONEscapeScanFn scan = getJSONEscapeScanners().back().second;
+
+  auto cur = str;
+  auto end = str + len;
+  while (cur < end) {
+    auto next = scan(cur, end);
+    out->append(cur, next - cur);
+    if (next == end) {
+      break;
+    }
+
+    appendJSONEscape(*next, out);
+    cur = next + 1;
+  }
+}
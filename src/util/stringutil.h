@@ -26,6 +26,7 @@
 #include <stdint.h>
 #include <string>
 #include <set>
+#include <utility>
 #include <vector>
 #include <locale>
 
@@ -75,6 +76,29 @@ public:
    */
   static std::string jsonEscape(const std::string& str);
 
+  /**
+   * JSON Escape the provided buffer and append the result to out
+   *
+   * @param str the buffer to escape
+   * @param len the length of the buffer in bytes
+   * @param out the string to append the escaped value to
+   */
+  static void jsonEscape(const char* str, size_t len, std::string* out);
+
+  /**
+   * Returns a pointer to the first char in [begin, end) that must be JSON
+   * escaped, or end if there is none
+   */
+  typedef const char* (*JSONEscapeScanFn)(const char* begin, const char* end);
+
+  /**
+   * Returns the JSON escape scanners that the CPU we are running on supports
+   * as (name, scanner) pairs, starting with the scalar one. jsonEscape uses
+   * the last (widest) one
+   */
+  static std::vector<std::pair<std::string, JSONEscapeScanFn>>
+      getJSONEscapeScanners();
+
   /**
    * JSON Unescape
    *
@@ -350,18 +374,16 @@ public:
 
 protected:
 
-  template <typename ValueType, typename... T>
-  static void formatImpl(
-      std::string* scratch,
-      int argn,
-      ValueType value,
-      T... values);
-
-  template <typename ValueType>
-  static void formatImpl(
-      std::string* scratch,
-      int argn,
-      ValueType value);
+  /**
+   * Substitute the $N placeholders in fmt with args[N] in a single pass over
+   * the format string. Placeholders that reference a missing value are left
+   * as they are
+   */
+  static std::string formatImpl(
+      const char* fmt,
+      size_t fmt_len,
+      const std::string* args,
+      size_t nargs);
 
 };
 
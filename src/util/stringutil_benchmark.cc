@@ -0,0 +1,118 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include "stringutil.h"
+
+/**
+ * Compares StringUtil::format with the previous implementation, which ran
+ * replaceAll over the whole string once per argument
+ */
+
+static const size_t kIterations = 1000000;
+
+static void formatReplaceAllImpl(std::string* scratch, int argn) {}
+
+template <typename ValueType, typename... T>
+static void formatReplaceAllImpl(
+    std::string* scratch,
+    int argn,
+    ValueType value,
+    T... values) {
+  StringUtil::replaceAll(
+      scratch,
+      "$" + std::to_string(argn),
+      StringUtil::toString(value));
+
+  formatReplaceAllImpl(scratch, argn + 1, values...);
+}
+
+template <typename... T>
+static std::string formatReplaceAll(const char* fmt, T... values) {
+  std::string str = fmt;
+  formatReplaceAllImpl(&str, 0, values...);
+  return str;
+}
+
+template <typename Fn>
+static void runBenchmark(const char* name, Fn fn) {
+  size_t bytes = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kIterations; ++i) {
+    bytes += fn(i).size();
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      end - begin).count();
+
+  printf(
+      "%-32s %8.1f ns/op  (%zu bytes)\n",
+      name,
+      double(nanos) / kIterations,
+      bytes);
+}
+
+int main(int argc, char** argv) {
+  static const char kEnvelope[] =
+      R"({"database": "$0", "table": "$1", "data": {)";
+  static const char kStatusLine[] =
+      "Uploading... $0 rows, $1MB buffered, $2MB on disk";
+  static const char kQuery[] =
+      "SELECT * FROM `$0`$1 ORDER BY $2 LIMIT $3";
+
+  runBenchmark("envelope, replaceAll", [] (size_t i) {
+    return formatReplaceAll(kEnvelope, "analytics", "pageviews");
+  });
+  runBenchmark("envelope, single pass", [] (size_t i) {
+    return StringUtil::format(kEnvelope, "analytics", "pageviews");
+  });
+
+  runBenchmark("status line, replaceAll", [] (size_t i) {
+    return formatReplaceAll(kStatusLine, i, i >> 10, i >> 12);
+  });
+  runBenchmark("status line, single pass", [] (size_t i) {
+    return StringUtil::format(kStatusLine, i, i >> 10, i >> 12);
+  });
+
+  runBenchmark("query, replaceAll", [] (size_t i) {
+    return formatReplaceAll(
+        kQuery,
+        "pageviews",
+        " WHERE (`id`) > (123456789)",
+        "`id`",
+        50000);
+  });
+  runBenchmark("query, single pass", [] (size_t i) {
+    return StringUtil::format(
+        kQuery,
+        "pageviews",
+        " WHERE (`id`) > (123456789)",
+        "`id`",
+        50000);
+  });
+
+  return 0;
+}
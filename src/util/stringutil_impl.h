@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string>
+#include <string.h>
 
 template <typename H, typename... T>
 void StringUtil::toStringVImpl(
@@ -42,43 +43,17 @@ std::vector<std::string> StringUtil::toStringV(T... values) {
   return target;
 }
 
-template <typename ValueType, typename... T>
-void StringUtil::formatImpl(
-    std::string* scratch,
-    int argn,
-    ValueType value,
-    T... values) {
-  StringUtil::replaceAll(
-      scratch,
-      "$" + std::to_string(argn),
-      StringUtil::toString(value));
-
-  formatImpl(scratch, argn + 1, values...);
-}
-
-template <typename ValueType>
-void StringUtil::formatImpl(
-    std::string* scratch,
-    int argn,
-    ValueType value) {
-  StringUtil::replaceAll(
-      scratch,
-      "$" + std::to_string(argn),
-      StringUtil::toString(value));
-}
-
 template <typename... T>
 std::string StringUtil::format(const char* fmt, T... values) {
-  std::string str = fmt;
-  StringUtil::formatImpl(&str, 0, values...);
-  return str;
+  /* the trailing element keeps the array non-empty for zero values */
+  const std::string args[] = { StringUtil::toString(values)..., std::string() };
+  return formatImpl(fmt, strlen(fmt), args, sizeof...(T));
 }
 
 template <typename... T>
 std::string StringUtil::format(const std::string& fmt, T... values) {
-  std::string str = fmt;
-  StringUtil::formatImpl(&str, 0, values...);
-  return str;
+  const std::string args[] = { StringUtil::toString(values)..., std::string() };
+  return formatImpl(fmt.data(), fmt.size(), args, sizeof...(T));
 }
 
 template <typename T>
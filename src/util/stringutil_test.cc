@@ -0,0 +1,177 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "stringutil.h"
+
+/**
+ * Checks the vectorized JSON escape scanners against the scalar one and
+ * jsonEscape against a byte-by-byte reference. Exits with a non-zero status
+ * if any check fails
+ */
+
+static const size_t kMaxOffset = 32;
+static const size_t kMaxLength = 100;
+
+static size_t num_failures = 0;
+
+static std::string escapeReference(const std::string& str) {
+  std::string out;
+  for (unsigned char chr : str) {
+    switch (chr) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\b': out += "\\b"; break;
+      case '\t': out += "\\t"; break;
+      case '\n': out += "\\n"; break;
+      case '\f': out += "\\f"; break;
+      case '\r': out += "\\r"; break;
+      default:
+        if (chr < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", chr);
+          out += buf;
+        } else {
+          out += chr;
+        }
+        break;
+    }
+  }
+
+  return out;
+}
+
+/**
+ * Scan buf[offset, offset + len) with every scanner and compare the result
+ * to the scalar scanner
+ */
+static void checkScanners(
+    const std::vector<std::pair<std::string, StringUtil::JSONEscapeScanFn>>&
+        scanners,
+    const char* buf,
+    size_t offset,
+    size_t len,
+    const char* desc) {
+  auto begin = buf + offset;
+  auto end = begin + len;
+  auto expected = scanners[0].second(begin, end);
+  for (size_t i = 1; i < scanners.size(); ++i) {
+    auto result = scanners[i].second(begin, end);
+    if (result != expected) {
+      fprintf(
+          stderr,
+          "FAIL: %s scanner, %s, offset=%zu len=%zu: got %zd, expected %zd\n",
+          scanners[i].first.c_str(),
+          desc,
+          offset,
+          len,
+          result - begin,
+          expected - begin);
+      ++num_failures;
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  auto scanners = StringUtil::getJSONEscapeScanners();
+  for (const auto& s : scanners) {
+    printf("testing the %s scanner\n", s.first.c_str());
+  }
+
+  /* bytes that must be escaped and bytes that must be passed through */
+  std::vector<unsigned char> special;
+  for (int chr = 0; chr < 0x20; ++chr) {
+    special.push_back(chr);
+  }
+  special.push_back('"');
+  special.push_back('\\');
+
+  std::vector<unsigned char> plain = { ' ', '/', 'a', '~' };
+  for (int chr = 0x7f; chr <= 0xff; ++chr) {
+    plain.push_back(chr);
+  }
+
+  /* the scanners must stop at the first special byte at any position */
+  std::vector<char> buf(kMaxOffset + kMaxLength + 32);
+  for (size_t offset = 0; offset < kMaxOffset; ++offset) {
+    for (size_t len = 0; len <= kMaxLength; ++len) {
+      for (auto fill : plain) {
+        memset(buf.data(), fill, buf.size());
+        checkScanners(scanners, buf.data(), offset, len, "no special byte");
+      }
+
+      /* a special byte just past the end must not be reported */
+      memset(buf.data(), 'a', buf.size());
+      buf[offset + len] = '"';
+      checkScanners(scanners, buf.data(), offset, len, "special byte at end");
+
+      for (size_t pos = 0; pos < len; ++pos) {
+        for (auto chr : special) {
+          memset(buf.data(), 0xff, buf.size());
+          buf[offset + pos] = chr;
+          checkScanners(scanners, buf.data(), offset, len, "special byte");
+
+          /* a second special byte must not hide the first one */
+          if (pos + 1 < len) {
+            buf[offset + len - 1] = '\\';
+            checkScanners(scanners, buf.data(), offset, len, "two specials");
+          }
+        }
+      }
+    }
+  }
+
+  /* jsonEscape must match the reference for every byte at any position */
+  for (int chr = 0; chr <= 0xff; ++chr) {
+    for (size_t len = 1; len <= 70; ++len) {
+      for (size_t pos = 0; pos < len; ++pos) {
+        std::string str(len, 'x');
+        str[pos] = chr;
+        str[len - 1] = 0xe4;
+
+        std::string escaped;
+        StringUtil::jsonEscape(str.data(), str.size(), &escaped);
+        if (escaped != escapeReference(str)) {
+          fprintf(
+              stderr,
+              "FAIL: jsonEscape, byte=0x%02x len=%zu pos=%zu\n",
+              chr,
+              len,
+              pos);
+          ++num_failures;
+        }
+      }
+    }
+  }
+
+  if (num_failures > 0) {
+    fprintf(stderr, "%zu checks failed\n", num_failures);
+    return 1;
+  }
+
+  printf("all checks passed\n");
+  return 0;
+}